@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MIPS_USERCOPY_H_
+#define _MIPS_USERCOPY_H_
+
+/*
+ * Fault-protected memory copy loops used by copyin/copyout and
+ * friends (in usercopy.S).
+ *
+ * usercopy copies LEN bytes from SRC to DEST and returns 0.
+ *
+ * usercopystr copies a null-terminated string of at most LEN bytes,
+ * stores the length (including the null) through GOTLEN if it is not
+ * NULL, and returns 0; or returns ENAMETOOLONG if no null was found.
+ *
+ * Either returns EFAULT if it takes an otherwise fatal fault. This is
+ * done through the fixup table below instead of setjmp/longjmp: when
+ * mips_trap gets a fatal kernel-mode fault whose EPC lies in
+ * [uf_start, uf_end), it resumes execution at uf_fixup.
+ */
+
+int usercopy(void *dest, const void *src, size_t len);
+int usercopystr(char *dest, const char *src, size_t len, size_t *gotlen);
+
+struct usercopy_fixup {
+	vaddr_t uf_start;	/* first instruction covered */
+	vaddr_t uf_end;		/* first instruction not covered */
+	vaddr_t uf_fixup;	/* where to resume */
+};
+
+/* Terminated by an entry with uf_start == 0. */
+extern const struct usercopy_fixup usercopy_fixups[];
+
+
+#endif /* _MIPS_USERCOPY_H_ */
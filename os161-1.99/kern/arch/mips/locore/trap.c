@@ -36,9 +36,11 @@
 #include <spl.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include <mips/usercopy.h>
 
 
 /* in exception.S */
@@ -47,6 +49,25 @@ extern void asm_usermode(struct trapframe *tf);
 /* called only from assembler, so not declared in a header */
 void mips_trap(struct trapframe *tf);
 
+/*
+ * Look up EPC in the copyin/copyout fixup table (see usercopy.S).
+ * Returns the address to resume at, or 0 if EPC is not in any of
+ * the protected copy loops.
+ */
+static
+vaddr_t
+usercopy_fixup(vaddr_t epc)
+{
+	const struct usercopy_fixup *uf;
+
+	for (uf = usercopy_fixups; uf->uf_start != 0; uf++) {
+		if (epc >= uf->uf_start && epc < uf->uf_end) {
+			return uf->uf_fixup;
+		}
+	}
+	return 0;
+}
+
 
 /* Names for trap codes */
 #define NTRAPCODES 13
@@ -128,6 +149,7 @@ mips_trap(struct trapframe *tf)
 	uint32_t code;
 	bool isutlb, iskern;
 	int spl;
+	vaddr_t fixup;
 
 	/* The trap frame is supposed to be 37 registers long. */
 	KASSERT(sizeof(struct trapframe)==(37*4));
@@ -141,6 +163,15 @@ mips_trap(struct trapframe *tf)
 
 	KASSERT(code < NTRAPCODES);
 
+	/*
+	 * Coming from user mode, the time since we last checked was
+	 * user time. (Interrupts are still off here.) The time until
+	 * we go back is kernel time; see done2 below.
+	 */
+	if (!iskern) {
+		thread_charge(true);
+	}
+
 	/* Make sure we haven't run off our stack */
 	if (curthread != NULL && curthread->t_stack != NULL) {
 		KASSERT((vaddr_t)tf > (vaddr_t)curthread->t_stack);
@@ -194,6 +225,17 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * If we interrupted a user thread whose process is
+		 * exiting, don't let it go back. As below, sync the
+		 * real interrupt state with the recorded one first.
+		 */
+		if (!iskern && curproc != NULL && curproc->p_exiting) {
+			spl = splhigh();
+			splx(spl);
+			proc_exitthread();
+		}
 		goto done2;
 	}
 
@@ -278,24 +320,30 @@ mips_trap(struct trapframe *tf)
 	/*
 	 * Fatal fault in kernel mode.
 	 *
-	 * If pcb_badfaultfunc is set, we do not panic; badfaultfunc is
-	 * set by copyin/copyout and related functions to signify that
-	 * the addresses they're accessing are userlevel-supplied and
-	 * not trustable. What we actually want to do is resume
-	 * execution at the function pointed to by badfaultfunc. That's 
-	 * going to be "copyfail" (see copyinout.c), which longjmps 
-	 * back to copyin/copyout or wherever and returns EFAULT.
+	 * If the fault happened inside one of the copyin/copyout copy
+	 * loops, we do not panic; the addresses they access are
+	 * userlevel-supplied and not trustable. Instead we resume
+	 * execution at the fixup address from the table in usercopy.S,
+	 * which makes the copy loop return EFAULT to its caller.
 	 *
-	 * Note that we do not just *call* this function, because that
+	 * Note that we do not just *call* the fixup, because that
 	 * won't necessarily do anything. We want the control flow
-	 * that is currently executing in copyin (or whichever), and
-	 * is stopped while we process the exception, to *teleport* to
-	 * copyfail.
+	 * that is currently executing in the copy loop, and is
+	 * stopped while we process the exception, to *teleport* to
+	 * the fixup.
 	 *
 	 * This is accomplished by changing tf->tf_epc and returning
-	 * from the exception handler.
+	 * from the exception handler. The same is done for
+	 * tm_badfaultfunc, which other code may set to get similar
+	 * treatment for faults elsewhere.
 	 */
 
+	fixup = usercopy_fixup(tf->tf_epc);
+	if (fixup != 0) {
+		tf->tf_epc = fixup;
+		goto done;
+	}
+
 	if (curthread != NULL &&
 	    curthread->t_machdep.tm_badfaultfunc != NULL) {
 		tf->tf_epc = (vaddr_t) curthread->t_machdep.tm_badfaultfunc;
@@ -321,6 +369,10 @@ mips_trap(struct trapframe *tf)
 	cpu_irqoff();
  done2:
 
+	if (!iskern) {
+		thread_charge(false);
+	}
+
 	/*
 	 * The boot thread can get here (e.g. on interrupt return) but
 	 * since it doesn't go to userlevel, it can't be returning to
@@ -376,6 +428,9 @@ mips_usermode(struct trapframe *tf)
 	spl0();
 	cpu_irqoff();
 
+	/* As on return from a trap, charge our time to the kernel. */
+	thread_charge(false);
+
 	cputhreads[curcpu->c_number] = (vaddr_t)curthread;
 	cpustacks[curcpu->c_number] = (vaddr_t)curthread->t_stack + STACK_SIZE;
 
@@ -34,6 +34,7 @@
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <syscall.h>
 
 
@@ -108,6 +109,46 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 				 (userptr_t)tf->tf_a1);
 		break;
+
+	    case SYS___thread_create:
+		err = sys___thread_create((userptr_t)tf->tf_a0,
+					  (userptr_t)tf->tf_a1,
+					  (userptr_t)tf->tf_a2,
+					  &retval);
+		break;
+
+	    case SYS_thread_join:
+		err = sys_thread_join((int)tf->tf_a0,
+				      (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_thread_exit:
+		sys_thread_exit((int)tf->tf_a0);
+		/* sys_thread_exit does not return */
+		panic("unexpected return from sys_thread_exit");
+		break;
+
+	    case SYS_futex:
+		err = sys_futex((userptr_t)tf->tf_a0,
+				(int)tf->tf_a1,
+				(int)tf->tf_a2,
+				&retval);
+		break;
+
+	    case SYS_sched_setaffinity:
+		err = sys_sched_setaffinity((pid_t)tf->tf_a0,
+					    (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_sched_getaffinity:
+		err = sys_sched_getaffinity((pid_t)tf->tf_a0,
+					    (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_getrusage:
+		err = sys_getrusage((int)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
 #ifdef UW
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
@@ -166,6 +207,11 @@ syscall(struct trapframe *tf)
 	KASSERT(curthread->t_curspl == 0);
 	/* ...or leak any spinlocks */
 	KASSERT(curthread->t_iplhigh_count == 0);
+
+	/* If another thread called _exit, don't go back to userlevel. */
+	if (curproc->p_exiting) {
+		proc_exitthread();
+	}
 }
 
 /*
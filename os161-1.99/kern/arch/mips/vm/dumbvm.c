@@ -46,6 +46,17 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
+/*
+ * Stacks for additional user threads: 16k each, stacked downward
+ * below the main stack, each with an unmapped guard page above it so
+ * that overflowing the stack above faults instead of scribbling on
+ * the one below.
+ */
+#define DUMBVM_TSTACKPAGES   4
+#define DUMBVM_TSTACKSLOT    ((DUMBVM_TSTACKPAGES + 1) * PAGE_SIZE)
+#define DUMBVM_STACKBASE     (USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE)
+#define DUMBVM_TSTACKBASE(n) (DUMBVM_STACKBASE - (n) * DUMBVM_TSTACKSLOT)
+
 /*
  * Wrap rma_stealmem in a spinlock.
  */
@@ -104,15 +115,79 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+/*
+ * Find the physical page backing user page VADDR in AS. Returns
+ * EFAULT if the address isn't in any of the regions.
+ */
+static
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+dumbvm_translate(struct addrspace *as, vaddr_t vaddr, paddr_t *ret)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	vaddr_t tstackbase;
+	unsigned n;
+
+	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_vbase1 != 0);
+	KASSERT(as->as_pbase1 != 0);
+	KASSERT(as->as_npages1 != 0);
+	KASSERT(as->as_vbase2 != 0);
+	KASSERT(as->as_pbase2 != 0);
+	KASSERT(as->as_npages2 != 0);
+	KASSERT(as->as_stackpbase != 0);
+	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
+	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
+	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
+	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
+	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
+
+	vaddr &= PAGE_FRAME;
+
+	vbase1 = as->as_vbase1;
+	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
+	vbase2 = as->as_vbase2;
+	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
+	stackbase = DUMBVM_STACKBASE;
+	stacktop = USERSTACK;
+	tstackbase = DUMBVM_TSTACKBASE(THREAD_MAX - 1);
+
+	if (vaddr >= vbase1 && vaddr < vtop1) {
+		*ret = (vaddr - vbase1) + as->as_pbase1;
+	}
+	else if (vaddr >= vbase2 && vaddr < vtop2) {
+		*ret = (vaddr - vbase2) + as->as_pbase2;
+	}
+	else if (vaddr >= stackbase && vaddr < stacktop) {
+		*ret = (vaddr - stackbase) + as->as_stackpbase;
+	}
+	else if (vaddr >= tstackbase && vaddr < stackbase) {
+		/* round up: the slot whose pages or guard page hold vaddr */
+		n = (stackbase - vaddr + DUMBVM_TSTACKSLOT - 1) /
+			DUMBVM_TSTACKSLOT;
+		KASSERT(n > 0 && n < THREAD_MAX);
+		if (as->as_tstackpbase[n] == 0 ||
+		    vaddr - DUMBVM_TSTACKBASE(n) >=
+		    DUMBVM_TSTACKPAGES * PAGE_SIZE) {
+			/* no such thread stack, or the guard page */
+			return EFAULT;
+		}
+		*ret = (vaddr - DUMBVM_TSTACKBASE(n)) + as->as_tstackpbase[n];
+	}
+	else {
+		return EFAULT;
+	}
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
 	paddr_t paddr;
 	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
 	int spl;
+	int result;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -147,38 +222,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
-	}
-	else {
-		return EFAULT;
+	result = dumbvm_translate(as, faultaddress, &paddr);
+	if (result) {
+		return result;
 	}
 
 	/* make sure it's page-aligned */
@@ -209,6 +255,8 @@ struct addrspace *
 as_create(void)
 {
 	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	unsigned i;
+
 	if (as==NULL) {
 		return NULL;
 	}
@@ -220,6 +268,9 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	for (i=0; i<THREAD_MAX; i++) {
+		as->as_tstackpbase[i] = 0;
+	}
 
 	return as;
 }
@@ -351,10 +402,60 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Thread stacks are allocated the first time their slot is used and
+ * then kept (like everything else under dumbvm) until the address
+ * space goes away, so handing a slot out again costs nothing and
+ * stale TLB entries for it on other CPUs remain correct.
+ */
+int
+as_define_threadstack(struct addrspace *as, unsigned n, vaddr_t *stackptr)
+{
+	paddr_t pa;
+
+	KASSERT(n > 0 && n < THREAD_MAX);
+	KASSERT(as->as_stackpbase != 0);
+
+	if (as->as_tstackpbase[n] == 0) {
+		pa = getppages(DUMBVM_TSTACKPAGES);
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		as_zero_region(pa, DUMBVM_TSTACKPAGES);
+		as->as_tstackpbase[n] = pa;
+	}
+
+	*stackptr = DUMBVM_TSTACKBASE(n) + DUMBVM_TSTACKPAGES * PAGE_SIZE;
+	return 0;
+}
+
+/*
+ * Lend the kernel the page frame behind user page VADDR. Under dumbvm
+ * frames are allocated once at load time and never move or get
+ * shared, so there is nothing to pin and no copy-on-write to set up;
+ * the loan is just the direct-mapped address of the frame.
+ */
+int
+as_loanpage(struct addrspace *as, vaddr_t vaddr, vaddr_t *kvaddr)
+{
+	paddr_t paddr;
+	int result;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	result = dumbvm_translate(as, vaddr, &paddr);
+	if (result) {
+		return result;
+	}
+	*kvaddr = PADDR_TO_KVADDR(paddr);
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	unsigned i;
 
 	new = as_create();
 	if (new==NULL) {
@@ -387,6 +488,20 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+
+	for (i=1; i<THREAD_MAX; i++) {
+		if (old->as_tstackpbase[i] == 0) {
+			continue;
+		}
+		new->as_tstackpbase[i] = getppages(DUMBVM_TSTACKPAGES);
+		if (new->as_tstackpbase[i] == 0) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(new->as_tstackpbase[i]),
+			(const void *)PADDR_TO_KVADDR(old->as_tstackpbase[i]),
+			DUMBVM_TSTACKPAGES*PAGE_SIZE);
+	}
 	
 	*ret = new;
 	return 0;
@@ -50,12 +50,19 @@
  */
 #define CPU_FREQUENCY 25000000 /* 25 MHz */
 
+/*
+ * Cycles ahead of c0_count that a new c0_compare value must be to be
+ * sure the counter hasn't passed it before the write lands.
+ */
+#define TIMER_SET_SLOP 100
+
 /*
  * Access to the on-chip timer.
  *
  * The c0_count register increments on every cycle; when the value
  * matches the c0_compare register, the timer interrupt line is
- * asserted. Writing to c0_compare again clears the interrupt.
+ * asserted and c0_count starts over from zero. Writing to c0_compare
+ * again clears the interrupt.
  */
 static
 void
@@ -73,6 +80,22 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -116,6 +139,49 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Reprogram the current cpu's on-chip timer. Because c0_count
+ * restarts from zero when the timer fires, it counts the cycles since
+ * the last timer interrupt, and c0_compare is the time of the next
+ * one measured from the last one.
+ *
+ * Interrupts should be off.
+ */
+void
+mainbus_timer_set(unsigned ticks)
+{
+	uint32_t count, compare;
+
+	KASSERT(ticks > 0);
+	KASSERT(ticks <= 0xffffffff / (CPU_FREQUENCY / HZ));
+
+	count = mips_timer_get();
+	compare = ticks * (CPU_FREQUENCY / HZ);
+	if (compare <= count + TIMER_SET_SLOP) {
+		/* Already late; fire right away rather than after wrapping */
+		compare = count + TIMER_SET_SLOP;
+	}
+	mips_timer_set(compare);
+}
+
+unsigned
+mainbus_timer_elapsed(void)
+{
+	return mips_timer_get() / (CPU_FREQUENCY / HZ);
+}
+
+uint32_t
+mainbus_cycles(void)
+{
+	return mips_timer_get();
+}
+
+uint32_t
+mainbus_cyclefreq(void)
+{
+	return CPU_FREQUENCY;
+}
+
 /*
  * Start all secondary CPUs.
  */
@@ -54,6 +54,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <atomic.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -192,8 +193,25 @@ con_input(void *vcs, int ch)
 
 	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
 	cs->cs_gotchars_head = nexthead;
-		
-	V(cs->cs_rsem);
+
+	atomic_add(&cs->cs_newchars, 1);
+	work_queue(&cs->cs_inputwork);
+}
+
+/*
+ * Deferred part of con_input: let readers at the characters that came
+ * in since we last ran.
+ */
+static
+void
+con_input_work(void *vcs)
+{
+	struct con_softc *cs = vcs;
+	unsigned n;
+
+	for (n = atomic_swap(&cs->cs_newchars, 0); n > 0; n--) {
+		V(cs->cs_rsem);
+	}
 }
 
 /*
@@ -441,6 +459,8 @@ config_con(struct con_softc *cs, int unit)
 	cs->cs_wsem = wsem; 
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	cs->cs_newchars = 0;
+	work_init(&cs->cs_inputwork, con_input_work, cs);
 
 	the_console = cs;
 	con_userlock_read = rlk;
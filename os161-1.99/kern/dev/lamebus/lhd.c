@@ -95,15 +95,29 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Completion work, run after the interrupt: poke the completion
+ * semaphore.
+ */
+static
+void
+lhd_iodone_work(void *vlh)
+{
+	struct lhd_softc *lh = vlh;
+
+	V(lh->lh_done);
+}
+
+/*
+ * Record that an I/O has completed: save the result and queue the
+ * wakeup. There's only ever one I/O outstanding (see lh_clear), so
+ * lh_result won't be overwritten before the waiter picks it up.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
 	lh->lh_result = err;
-	V(lh->lh_done);
+	work_queue(&lh->lh_work);
 }
 
 /*
@@ -290,7 +304,7 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
 	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
+	lh->lh_clear = sem_create_handoff("lhd-clear", 1);
 	if (lh->lh_clear == NULL) {
 		return ENOMEM;
 	}
@@ -300,6 +314,7 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 		lh->lh_clear = NULL;
 		return ENOMEM;
 	}
+	work_init(&lh->lh_work, lhd_iodone_work, lh);
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
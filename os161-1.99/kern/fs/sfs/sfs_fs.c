@@ -42,6 +42,7 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <kmem_cache.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
@@ -282,6 +283,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	/* Vnodes for all sfs volumes come from one cache. */
+	if (sfs_vnode_objcache == NULL) {
+		sfs_vnode_objcache = kmem_cache_create("sfs_vnode",
+						       sizeof(struct sfs_vnode),
+						       0, NULL);
+		if (sfs_vnode_objcache == NULL) {
+			vfs_biglock_release();
+			return ENOMEM;
+		}
+	}
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
@@ -44,6 +44,10 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <kmem_cache.h>
+
+/* Where sfs_vnodes come from; made at the first mount */
+struct kmem_cache *sfs_vnode_objcache;
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
@@ -953,7 +957,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(sfs_vnode_objcache, sv);
 
 	/* Done */
 	return 0;
@@ -1685,7 +1689,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(sfs_vnode_objcache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1703,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_objcache, sv);
 		return result;
 	}
 
@@ -1736,7 +1740,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_objcache, sv);
 		return result;
 	}
 
@@ -1747,7 +1751,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_objcache, sv);
 		return result;
 	}
 
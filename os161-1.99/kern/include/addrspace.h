@@ -35,6 +35,7 @@
  */
 
 
+#include <limits.h>
 #include <vm.h>
 
 struct vnode;
@@ -55,6 +56,7 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
+  paddr_t as_tstackpbase[THREAD_MAX];	/* extra thread stacks; [0] unused */
 };
 
 /*
@@ -91,6 +93,18 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_threadstack - set up the user stack for thread id N
+ *                (1 <= N < THREAD_MAX) of a multithreaded process and
+ *                hand back its initial stack pointer. Thread 0 uses
+ *                the stack from as_define_stack. A stack may be
+ *                handed out again once its previous thread is gone.
+ *
+ *    as_loanpage - hand back a kernel address through which the page
+ *                frame backing user page VADDR can be accessed
+ *                directly, without going through the user mapping.
+ *                Used by uiomove for large page-aligned transfers.
+ *                Returns EFAULT if the page is not mapped.
  */
 
 struct addrspace *as_create(void);
@@ -107,6 +121,10 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_threadstack(struct addrspace *as, unsigned n,
+                                        vaddr_t *stackptr);
+int               as_loanpage(struct addrspace *as, vaddr_t vaddr,
+                              vaddr_t *kvaddr);
 
 
 /*
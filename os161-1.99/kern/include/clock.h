@@ -38,8 +38,10 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU every LT_GRANULARITY usec to
+ * allow simple timed operations: it arranges (through deferred work)
+ * to wake up threads in clocksleep(), clocknap(), and clockwait()
+ * whose time has come.
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -61,8 +63,29 @@ void hardclock_bootstrap(void);
 void hardclock(void);
 void timerclock(void);
 
+/*
+ * Dynamic ticks. hardclock_stop asks for no hardclocks on the current
+ * CPU for up to MAXTICKS periods; hardclock_resume restarts them. The
+ * run queue lock must be held. Setting hardclock_dynamic to 0 turns
+ * hardclock_stop into a no-op.
+ */
+void hardclock_stop(unsigned maxticks);
+void hardclock_resume(void);
+extern int hardclock_dynamic;
+
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
+/*
+ * Cheap clock for CPU accounting. clock_cycles() returns the number of
+ * cycles the current CPU's clock has counted, made up from its
+ * hardclock count and cycle counter; it must be called with
+ * interrupts off. It never goes backwards on one CPU, and different
+ * CPUs agree to within about a hardclock period. clock_cycles_usec()
+ * converts a count of cycles to microseconds.
+ */
+uint64_t clock_cycles(void);
+uint64_t clock_cycles_usec(uint64_t cycles);
+
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
                  time_t *rsecs, uint32_t *rnsecs);
@@ -70,8 +93,6 @@ void getinterval(time_t secs1, uint32_t nsecs,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
- *
- *  this will be more efficient than clocknap() for longer sleeps
  */
 void clocksleep(int seconds);
 
@@ -83,5 +104,11 @@ void clocksleep(int seconds);
  */
 void clocknap(int ticks);
 
+/*
+ * clockwait() suspends execution for SECS seconds plus NSECS
+ * nanoseconds, rounded up to the timer tick.
+ */
+void clockwait(time_t secs, uint32_t nsecs);
+
 
 #endif /* _CLOCK_H_ */
@@ -35,6 +35,9 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct work;	/* from <workq.h> */
+struct wchan;	/* from <wchan.h> */
+
 
 /*
  * Per-cpu structure
@@ -46,6 +49,20 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/*
+ * Number of priority levels in the per-cpu run queue. Level 0 is the
+ * highest priority; see schedule() in thread.c.
+ */
+#define SCHED_NLEVELS 4
+
+/*
+ * Sets of cpus, for affinity. Bit N stands for the cpu whose c_number
+ * is N, so there can be at most CPU_MAX cpus.
+ */
+#define CPU_MAX		32
+#define CPUMASK_ALL	0xffffffffU
+#define CPUMASK_BIT(c)	(1U << (c)->c_number)
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -60,15 +77,56 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_hardclocks0;		/* c_hardclocks when cpu started */
+	unsigned c_steals;		/* Successful steals by this cpu */
+	unsigned c_stealfails;		/* Steals that found nothing */
+	unsigned c_migrations;		/* Threads pushed to other cpus */
+	unsigned c_tickperiod;		/* Hardclocks the timer is set for */
+	unsigned c_ticksavoided;	/* Timer interrupts not taken */
+	uint64_t c_lastclock;		/* Last clock_cycles() value */
+	uint64_t c_idletime;		/* Cycles spent in cpu_idle() */
+	unsigned c_vcsw;		/* Switches away from sleepers */
+	unsigned c_ivcsw;		/* Switches away from runnables */
+	struct mcsnode c_mcsnodes[SPINLOCK_MCSNODES]; /* For MCS spinlocks */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
+	 *
+	 * c_runcount is only changed with the lock held, but may be
+	 * read without it as a hint for load balancing.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues */
+	volatile unsigned c_runcount;	/* Total threads on c_runqueue[] */
+	bool c_tickless;		/* Periodic hardclocks stopped */
+	uint64_t c_rqwait;		/* Total cycles threads queued */
+	unsigned c_rqdispatches;	/* Threads taken off to run */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Cache of exited threads for thread_fork to reuse. Mostly
+	 * accessed by this cpu; other cpus lock it only to reclaim
+	 * memory or print stats.
+	 * Protected by the thread cache lock.
+	 */
+	struct threadlist c_threadcache;
+	unsigned c_threadcache_hits;
+	unsigned c_threadcache_misses;
+	struct spinlock c_threadcache_lock;
+
+	/*
+	 * Deferred work queued by interrupt handlers on this cpu, and
+	 * run by its worker thread (see workq.c). c_work_wchan is NULL
+	 * until the worker has been started.
+	 * Protected by the work lock.
+	 */
+	struct work *c_work_head;
+	struct work **c_work_tail;
+	struct wchan *c_work_wchan;
+	bool c_work_idle;		/* Worker is asleep */
+	struct spinlock c_work_lock;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -99,12 +157,15 @@ struct cpu {
  *
  * cpu_create calls cpu_machdep_init.
  *
+ * cpu_presentmask returns the set of cpus that have been created.
+ *
  * cpu_start_secondary is the platform-dependent assembly language
  * entry point for new CPUs; it can be found in start.S. It calls
  * cpu_hatch after having claimed the startup stack and thread created
  * for the cpu.
  */
 struct cpu *cpu_create(unsigned hardware_number);
+uint32_t cpu_presentmask(void);
 void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
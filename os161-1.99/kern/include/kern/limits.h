@@ -96,5 +96,8 @@
 /* Max number of iovec structures at once for readv/writev/preadv/pwritev */
 #define __IOV_MAX       1024
 
+/* Max threads per process, including the initial thread */
+#define __THREAD_MAX    16
+
 
 #endif /* _KERN_LIMITS_H_ */
@@ -36,6 +36,8 @@
  * Not very important.
  */
 
+#include <kern/time.h>	/* for struct timeval */
+
 
 /* priorities for setpriority() */
 #define PRIO_MIN	(-20)
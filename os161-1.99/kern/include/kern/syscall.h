@@ -86,7 +86,7 @@
 //#define SYS_sigaltstack 33
 //                              (resource tracking and usage)
 //#define SYS_wait4      34
-//#define SYS_getrusage  35
+#define SYS_getrusage  35
 //                              (resource limits)
 //#define SYS_getrlimit  36
 //#define SYS_setrlimit  37
@@ -197,6 +197,16 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 
+//                              -- Threads --
+#define SYS___thread_create 121
+#define SYS_thread_join  122
+#define SYS_thread_exit  123
+#define SYS_futex        124
+
+//                              -- Scheduling --
+#define SYS_sched_setaffinity 125
+#define SYS_sched_getaffinity 126
+
 /*CALLEND*/
 
 
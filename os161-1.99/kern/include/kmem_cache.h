@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches (slab allocator).
+ *
+ * kmalloc rounds every request up to one of a few power-of-two block
+ * sizes, so a 520-byte object takes 1024 bytes. A kmem_cache hands out
+ * objects of one fixed size instead, packed into pages ("slabs") with
+ * only as much padding as the alignment requires.
+ *
+ * If a constructor is given, it's applied to each object once, when
+ * its slab is set up, not on every allocation. Objects must be
+ * returned to the cache in their constructed state (e.g. locks
+ * unheld, lists empty), so the next user gets them that way for free.
+ * There is no destructor; constructed state may not own other memory.
+ *
+ * kmem_cache_create makes a cache for objects of SIZE bytes aligned
+ * to ALIGN (a power of two; 0 means the natural alignment of
+ * kmalloc). It returns NULL if out of memory. Objects must fit in a
+ * page. kmem_cache_destroy requires that every object has been freed.
+ *
+ * kmem_cache_alloc returns NULL if out of memory. kmem_cache_free
+ * must be given the cache the object came from.
+ *
+ * Each cache keeps a few empty slabs for reuse; kmem_cache_reap frees
+ * those of every cache, for use under memory pressure, and returns
+ * the number of pages freed. kmem_cache_printstats prints per-cache
+ * statistics (it's called by kheap_printstats).
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+unsigned kmem_cache_reap(void);
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEM_CACHE_H_ */
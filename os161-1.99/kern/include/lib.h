@@ -122,10 +122,16 @@ uint32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ *
+ * kheap_bootstrap must be called once the RAM size is known and
+ * before anything calls kmalloc; kheap_initcpu sets up the per-cpu
+ * part of the heap for a new cpu.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_bootstrap(void);
+void kheap_initcpu(unsigned cpunum);
 
 /*
  * C string functions. 
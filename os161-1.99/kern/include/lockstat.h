@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock statistics.
+ *
+ * With "options lockstat" in the kernel config, spinlocks, semaphores,
+ * locks and CVs count how often they are taken, how often the taker
+ * had to wait, how many cycles it spent waiting (total and worst
+ * case), how long the lock was held, and how many times a thread went
+ * to sleep on it. Records live in a fixed-size table indexed by the
+ * lock's address, and carry the lock's name (spinlocks have none, so
+ * are shown by address). The "lockstat" menu command prints the most
+ * contended locks and resets the counters.
+ *
+ * Each primitive keeps a pointer to its record, looked up the first
+ * time the lock is used. Counters are updated while holding the lock
+ * (or its internal spinlock) they describe, so need no locking of
+ * their own. The exception is the semaphore fast path, which has no
+ * lock, so semaphore counts may come out slightly low.
+ *
+ * Cycle counts come from mainbus_cycles() and so are approximate for
+ * waits that span a hardclock.
+ *
+ * Without the option, the pointer field is not there and the
+ * LOCKSTAT_* macros expand to nothing.
+ */
+
+#include "opt-lockstat.h"
+
+/* Kinds of lock */
+#define LOCKSTAT_SPINLOCK	0
+#define LOCKSTAT_SEM		1
+#define LOCKSTAT_LOCK		2
+#define LOCKSTAT_CV		3
+
+#define LOCKSTAT_NAMELEN	24
+
+struct lockstat {
+	const void *ls_lock;		/* Lock this describes, or NULL */
+	unsigned ls_kind;		/* LOCKSTAT_* */
+	char ls_name[LOCKSTAT_NAMELEN];	/* Copy of the lock's name */
+	uint32_t ls_acquires;		/* Times acquired */
+	uint32_t ls_contended;		/* Times the acquirer had to wait */
+	uint32_t ls_sleeps;		/* Times a thread slept on it */
+	uint32_t ls_maxspin;		/* Longest wait, in cycles */
+	uint64_t ls_spincycles;		/* Total cycles spent waiting */
+	uint64_t ls_holdcycles;		/* Total cycles held */
+	uint32_t ls_holdstart;		/* When the current holder got it */
+};
+
+#if OPT_LOCKSTAT
+
+uint32_t lockstat_now(void);
+void lockstat_acquired(struct lockstat **lsp, const void *lock,
+		       unsigned kind, const char *name,
+		       bool contended, uint32_t start);
+void lockstat_released(struct lockstat *ls);
+void lockstat_slept(struct lockstat **lsp, const void *lock,
+		    unsigned kind, const char *name);
+void lockstat_forget(struct lockstat **lsp);
+
+#define LOCKSTAT_NOW()	lockstat_now()
+#define LOCKSTAT_INIT(lsp) \
+	((lsp) = NULL)
+#define LOCKSTAT_ACQUIRED(lsp, lock, kind, name, contended, start) \
+	lockstat_acquired(&(lsp), lock, kind, name, contended, start)
+#define LOCKSTAT_RELEASED(lsp) \
+	lockstat_released(lsp)
+#define LOCKSTAT_SLEPT(lsp, lock, kind, name) \
+	lockstat_slept(&(lsp), lock, kind, name)
+#define LOCKSTAT_FORGET(lsp) \
+	lockstat_forget(&(lsp))
+
+/*
+ * Menu support: print the N most contended locks, or zero all the
+ * counters.
+ */
+void lockstat_print(unsigned n);
+void lockstat_reset(void);
+
+#else
+
+#define LOCKSTAT_NOW()	0
+#define LOCKSTAT_INIT(lsp)
+#define LOCKSTAT_ACQUIRED(lsp, lock, kind, name, contended, start) \
+	((void)(contended), (void)(start))
+#define LOCKSTAT_RELEASED(lsp)
+#define LOCKSTAT_SLEPT(lsp, lock, kind, name)
+#define LOCKSTAT_FORGET(lsp)
+
+#endif /* OPT_LOCKSTAT */
+
+
+#endif /* _LOCKSTAT_H_ */
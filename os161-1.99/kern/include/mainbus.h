@@ -55,6 +55,28 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Control of the current cpu's hardclock timer, for dynamic ticks.
+ * mainbus_timer_set arranges for the next timer interrupt to come
+ * TICKS hardclock periods after the last one (or as soon as possible
+ * if that time has passed); mainbus_timer_elapsed returns the number
+ * of whole periods since the last one.
+ */
+void mainbus_timer_set(unsigned ticks);
+unsigned mainbus_timer_elapsed(void);
+
+/*
+ * Read the current cpu's cycle counter. This restarts from zero at
+ * each hardclock interrupt, so it's only good for timing short
+ * intervals.
+ */
+uint32_t mainbus_cycles(void);
+
+/*
+ * Number of cycles per second counted by mainbus_cycles().
+ */
+uint32_t mainbus_cyclefreq(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -36,15 +36,22 @@
  * Note: curproc is defined by <current.h>.
  */
 
+#include <limits.h>
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 
 struct addrspace;
 struct vnode;
+struct wchan;
 #ifdef UW
 struct semaphore;
 #endif // UW
 
+/* States of the user-level thread slots in p_tstate. */
+#define PT_FREE     0	/* unused */
+#define PT_RUNNING  1	/* in use by a live thread */
+#define PT_ZOMBIE   2	/* exited, waiting for thread_join */
+
 /*
  * Process structure.
  */
@@ -59,6 +66,34 @@ struct proc {
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 
+	/*
+	 * User-level threads. A thread's id (t_tid) indexes these
+	 * arrays; the initial thread is id 0. p_tstate and p_tstatus
+	 * are protected by p_lock. Once p_exiting is set, every thread
+	 * leaves the process the next time it is in the kernel.
+	 */
+	int p_tstate[THREAD_MAX];	/* PT_* state of each thread id */
+	int p_tstatus[THREAD_MAX];	/* thread_exit code of zombies */
+	struct wchan *p_tjoinwchan;	/* thread_join sleeps here */
+	volatile bool p_exiting;	/* _exit has been called */
+
+	/*
+	 * CPUs the process's threads may run on (see CPUMASK_BIT in
+	 * cpu.h). New threads get it as their t_cpumask. Protected by
+	 * p_lock.
+	 */
+	uint32_t p_cpumask;
+
+	/*
+	 * CPU usage of threads that have left the process, in
+	 * clock_cycles() units (see thread_charge). getrusage adds the
+	 * live threads' usage to these. Protected by p_lock.
+	 */
+	uint64_t p_utime;
+	uint64_t p_stime;
+	unsigned p_nvcsw;
+	unsigned p_nivcsw;
+
 #ifdef UW
   /* a vnode to refer to the console device */
   /* this is a quick-and-dirty way to get console writes working */
@@ -91,8 +126,15 @@ void proc_destroy(struct proc *proc);
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
-/* Detach a thread from its process. */
-void proc_remthread(struct thread *t);
+/* Detach a thread from its process. Returns the number of threads left. */
+unsigned proc_remthread(struct thread *t);
+
+/*
+ * Detach the current thread from its process and exit. The last
+ * thread out destroys the address space and the process. Does not
+ * return.
+ */
+void proc_exitthread(void);
 
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
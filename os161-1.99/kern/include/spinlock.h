@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include <lockstat.h>
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -45,6 +46,36 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+/*
+ * Kinds of spinlock.
+ *
+ * SPINLOCK_TAS		Plain test-and-test-and-set. Cheapest when
+ *			uncontended, but unfair, and every waiter spins
+ *			on (and bounces) the same cache line.
+ * SPINLOCK_TICKET	FIFO ticket lock: take a number, wait until it
+ *			is served. Bounded wait; waiters still share
+ *			one line. This is the default.
+ * SPINLOCK_MCS		MCS queue lock: each waiter spins on its own
+ *			queue node and the holder hands off directly to
+ *			the next one. FIFO, and only one line moves per
+ *			handoff. Worth it for the most contended locks.
+ */
+#define SPINLOCK_TAS	0
+#define SPINLOCK_TICKET	1
+#define SPINLOCK_MCS	2
+
+/*
+ * MCS queue node. Each cpu has a small pool of these (see struct cpu)
+ * since it needs one per MCS lock it is holding or waiting for.
+ */
+struct mcsnode {
+	struct mcsnode *volatile mn_next; /* Next waiter in the queue */
+	volatile bool mn_locked;	/* True while we must keep waiting */
+	bool mn_inuse;			/* Allocated from the pool */
+};
+
+#define SPINLOCK_MCSNODES	8	/* Per-cpu MCS node pool size */
+
 /*
  * Basic spinlock.
  *
@@ -55,19 +86,35 @@
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_lock; /* TAS: the word where we spin. */
+	volatile unsigned lk_next;	/* Ticket: next ticket to hand out */
+	volatile unsigned lk_serving;	/* Ticket: ticket now being served */
+	struct mcsnode *volatile lk_tail; /* MCS: last in queue, or NULL */
+	struct mcsnode *lk_node;	/* MCS: the holder's queue node */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+	unsigned lk_kind;		/* SPINLOCK_TAS/TICKET/MCS */
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stat;	/* Statistics */
+#endif
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKSTAT
+#define SPINLOCK_INITIALIZER_KIND(kind) \
+	{ SPINLOCK_DATA_INITIALIZER, 0, 0, NULL, NULL, NULL, kind, NULL }
+#else
+#define SPINLOCK_INITIALIZER_KIND(kind) \
+	{ SPINLOCK_DATA_INITIALIZER, 0, 0, NULL, NULL, NULL, kind }
+#endif
+#define SPINLOCK_INITIALIZER	SPINLOCK_INITIALIZER_KIND(SPINLOCK_TICKET)
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
+ * init_kind	Same, but choose the kind of lock.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
@@ -77,6 +124,7 @@ struct spinlock {
  */
 
 void spinlock_init(struct spinlock *lk);
+void spinlock_init_kind(struct spinlock *lk, unsigned kind);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
@@ -36,21 +36,51 @@
 
 
 #include <spinlock.h>
+#include <cpu.h>	/* for SCHED_NLEVELS */
 
 /*
  * Dijkstra-style semaphore.
  *
  * The name field is for easier debugging. A copy of the name is made
  * internally.
+ *
+ * sem_count is changed with atomic operations, so P with a positive
+ * count and V with nobody asleep never take sem_lock or touch the
+ * wchan. sem_nwaiters counts threads in the slow path of P, and is
+ * what V checks to decide whether a wakeup is needed.
+ *
+ * A semaphore made with sem_create_handoff hands each unit released
+ * by V straight to the thread it wakes (sem_handoff counts units
+ * passed on but not yet collected), and only puts it in sem_count if
+ * nobody is waiting. New callers of P queue behind existing sleepers
+ * instead of taking the count, so a woken thread can't lose its unit
+ * and a stream of arrivals can't starve the sleepers. V on such a
+ * semaphore always takes sem_lock. A plain semaphore lets the woken
+ * thread compete for the count, which is cheaper but unfair.
+ *
+ * sem_nwaiters and sem_handoff are protected by sem_lock.
  */
 struct semaphore {
         char *sem_name;
 	struct wchan *sem_wchan;
 	struct spinlock sem_lock;
-        volatile int sem_count;
+        volatile unsigned sem_count;
+	volatile unsigned sem_nwaiters;
+	unsigned sem_handoff;
+	bool sem_fifo;
+#if OPT_LOCKSTAT
+	struct lockstat *sem_stat;
+#endif
 };
 
+/*
+ * Call once during system startup, before any semaphores, locks, or
+ * CVs are made, to set up the object caches they come from.
+ */
+void synch_bootstrap(void);
+
 struct semaphore *sem_create(const char *name, int initial_count);
+struct semaphore *sem_create_handoff(const char *name, int initial_count);
 void sem_destroy(struct semaphore *);
 
 /*
@@ -71,11 +101,37 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * The lock is adaptive: lk_owner holds the owning thread pointer (0
+ * when free), and the low bit LK_WAITERS is set while anyone might be
+ * asleep on lk_wchan. Uncontended acquire and release are a single
+ * atomic_cas each and never touch the spinlock or the wchan. A
+ * contender spins for a while if the owner is running on another CPU,
+ * and goes to sleep otherwise. lk_nwaiters is protected by
+ * lk_spinlock.
+ *
+ * Priority inheritance: a thread that goes to sleep on the lock counts
+ * itself in lk_pilevels at its effective priority, and the owner is
+ * scheduled at the best level counted on any lock it holds (and so on
+ * down the chain, if the owner is itself waiting for a lock). The
+ * locks a thread holds with waiters counted are chained through
+ * lk_pinext from its t_pilocks. These fields are protected by the
+ * priority inheritance spinlock in synch.c.
  */
+#define LK_WAITERS	((unsigned)1)
+
 struct lock {
         char *lk_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+	volatile unsigned lk_owner;
+	struct wchan *lk_wchan;
+	struct spinlock lk_spinlock;
+	unsigned lk_nwaiters;
+	unsigned lk_pilevels[SCHED_NLEVELS];	/* Waiters at each level */
+	struct thread *lk_piowner;	/* Thread whose t_pilocks we're on */
+	struct lock *lk_pinext;		/* Next on lk_piowner's t_pilocks */
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stat;
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -96,6 +152,12 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+/*
+ * Turns priority inheritance for locks on and off (default on). Meant
+ * for testing and measurement.
+ */
+extern bool lock_priority_inheritance;
+
 
 /*
  * Condition variable.
@@ -113,8 +175,11 @@ void lock_destroy(struct lock *);
 
 struct cv {
         char *cv_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+	struct wchan *cv_wchan;
+	unsigned cv_nwaiters;		/* Protected by the caller's lock */
+#if OPT_LOCKSTAT
+	struct lockstat *cv_stat;
+#endif
 };
 
 struct cv *cv_create(const char *name);
@@ -131,11 +196,76 @@ void cv_destroy(struct cv *);
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
  *
- * These operations must be atomic. You get to write them.
+ * cv_signal and cv_broadcast don't actually wake anybody: since the
+ * caller holds the lock, a woken thread would only block on it again.
+ * Instead they move waiters straight onto the lock's own wait queue
+ * ("wait morphing"), and lock_release wakes them one at a time.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads may hold the lock for reading at once, or one
+ * thread may hold it for writing. Writers are preferred: once a writer
+ * is waiting, new readers block until it has had its turn, so a steady
+ * stream of readers can't starve writers out. (A consequence is that
+ * read locks must not be taken recursively.)
+ *
+ * rw_word holds the count of active readers in the low bits plus
+ * RW_WRITER, RW_WWAIT (writers asleep) and RW_RWAIT (readers asleep).
+ * As with struct lock, uncontended read and write acquire/release are
+ * a single atomic_cas; the spinlock, the waiter counts and the wchans
+ * are only used when someone has to sleep.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+#define RW_WRITER	((unsigned)0x80000000)
+#define RW_WWAIT	((unsigned)0x40000000)
+#define RW_RWAIT	((unsigned)0x20000000)
+#define RW_READMASK	((unsigned)0x1fffffff)
+
+struct rwlock {
+	char *rw_name;
+	volatile unsigned rw_word;
+	struct thread *rw_writer;
+	struct wchan *rw_rwchan;
+	struct wchan *rw_wwchan;
+	struct spinlock rw_spinlock;
+	unsigned rw_nrwait;
+	unsigned rw_nwwait;
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Blocks while a
+ *                           writer holds the lock or is waiting for it.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing, once all readers
+ *                           and any other writer have gone.
+ *    rwlock_release_write - Give up a write hold.
+ *    rwlock_tryupgrade    - Turn the caller's read hold into a write
+ *                           hold if it is the only reader. Returns false
+ *                           (still holding for reading) otherwise.
+ *    rwlock_downgrade     - Turn the caller's write hold into a read
+ *                           hold without letting a writer in between.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_tryupgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
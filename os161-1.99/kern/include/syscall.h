@@ -57,6 +57,14 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys___thread_create(userptr_t start, userptr_t func, userptr_t arg,
+			int *retval);
+int sys_thread_join(int tid, userptr_t status);
+void sys_thread_exit(int exitcode);
+int sys_futex(userptr_t uaddr, int op, int val, int *retval);
+int sys_sched_setaffinity(pid_t pid, userptr_t mask);
+int sys_sched_getaffinity(pid_t pid, userptr_t mask);
+int sys_getrusage(int who, userptr_t usage);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
@@ -60,6 +60,10 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
+int rwbench(int, char **);
+int spinbench(int, char **);
+int pitest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -79,6 +83,8 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int cachetest(int, char **);
+int copybench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -83,6 +84,46 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_priority;		/* Run queue level (0 = highest) */
+	int t_quantum;			/* Hardclocks left at this level */
+	struct cpu *t_lastcpu;		/* CPU thread last ran on */
+	unsigned t_lastrun;		/* t_lastcpu's c_hardclocks then */
+	struct cpu *t_rqcpu;		/* CPU whose run queue it's on */
+	unsigned t_rqlevel;		/* Level of that run queue */
+	uint32_t t_cpumask;		/* CPUs it may run on */
+
+	/*
+	 * Priority inheritance (see synch.c). t_inherited is the best
+	 * level passed on by threads waiting for locks we hold, or
+	 * SCHED_NLEVELS if none; the thread is scheduled at the better
+	 * of that and t_priority. t_pilocks lists the locks we hold
+	 * that have waiters counted against them. Protected by the
+	 * priority inheritance spinlock in synch.c. t_rqcpu and
+	 * t_rqlevel are protected by the run queue lock of t_rqcpu.
+	 */
+	unsigned t_inherited;		/* Level inherited through locks */
+	struct lock *t_blockedon;	/* Lock we are asleep waiting for */
+	unsigned t_pilevel;		/* Level we count as in t_blockedon */
+	struct lock *t_pilocks;		/* Held locks that have waiters */
+
+	/*
+	 * Accounting, in clock_cycles() units (see thread_charge).
+	 * t_acctstamp is when time was last charged. t_rqstamp is when
+	 * the thread last became runnable; moving between run queues
+	 * doesn't change it. Written by the thread itself or under the
+	 * run queue lock of its cpu, and read by others without locking,
+	 * for statistics. allthreads (in thread.c) links every live
+	 * thread except the secondary cpus' startup threads.
+	 */
+	uint64_t t_utime;		/* Time spent in user mode */
+	uint64_t t_stime;		/* Time spent in the kernel */
+	uint64_t t_acctstamp;		/* Clock when last charged */
+	uint64_t t_rqstamp;		/* Clock when made runnable */
+	uint64_t t_rqwait;		/* Time spent on run queues */
+	unsigned t_nvcsw;		/* Voluntary context switches */
+	unsigned t_nivcsw;		/* Involuntary context switches */
+	struct thread *t_allnext;	/* Next in allthreads */
+	struct thread **t_allprev;	/* Pointer to us in allthreads */
 
 	/*
 	 * Interrupt state fields.
@@ -105,6 +146,8 @@ struct thread {
 	 * Public fields
 	 */
 
+	unsigned t_tid;			/* User thread id within t_proc */
+
 	/* add more here as needed */
 };
 
@@ -158,9 +201,17 @@ void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Charge the current thread for one hardclock, and yield if its
+ * quantum has expired or a higher-priority thread is waiting. Called
+ * from the timer interrupt.
  */
-void schedule(void);
+void thread_tick(void);
+
+/*
+ * Reshuffle the run queue. Called from the timer interrupt, with the
+ * hardclock count from before this interrupt.
+ */
+void schedule(unsigned then);
 
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
@@ -168,5 +219,57 @@ void schedule(void);
  */
 void thread_consider_migration(void);
 
+/*
+ * Thread cache: threadcache_reclaim frees all cached exited threads
+ * and returns how many it freed (for use under memory pressure);
+ * threadcache_printstats prints occupancy and hit rates.
+ */
+unsigned threadcache_reclaim(void);
+void threadcache_printstats(void);
+
+/*
+ * Threads that ran within this many hardclocks are considered
+ * cache-hot and are not migrated unless the load is badly unbalanced.
+ */
+extern unsigned thread_hot_hardclocks;
+
+/*
+ * Priority inheritance support.
+ *
+ * thread_effpriority returns the level a thread is scheduled at.
+ * thread_setinherited sets the level it inherits through locks (or
+ * SCHED_NLEVELS for none), moving it if it's on a run queue.
+ */
+unsigned thread_effpriority(struct thread *t);
+void thread_setinherited(struct thread *t, unsigned level);
+
+/*
+ * CPU affinity. thread_setcpumask restricts a thread to the cpus in
+ * MASK (see CPUMASK_BIT in cpu.h); it fails with EINVAL if none of
+ * them exist. The current thread is moved off the cpu at once if it
+ * has to be. Another thread moves the next time it is woken up or
+ * load balanced, so one that's running now may run a little longer
+ * where it is.
+ */
+int thread_setcpumask(struct thread *t, uint32_t mask);
+
+/*
+ * Print the per-level run queue lengths, load balancing counters, and
+ * ticks avoided of every CPU.
+ */
+void thread_printrunqueues(void);
+
+/*
+ * CPU accounting. thread_charge charges the time since the current
+ * thread was last charged to its user time if USER is true, or else
+ * its kernel time; interrupts must be off. It is called on the way
+ * into and out of user mode and by the context switch code.
+ * thread_printtop prints each CPU's utilization, idle time, context
+ * switches, and run queue wait, and the NTOP threads that have used
+ * the most CPU time.
+ */
+void thread_charge(bool user);
+void thread_printtop(unsigned ntop);
+
 
 #endif /* _THREAD_H_ */
@@ -96,9 +96,17 @@ struct uio {
  * When uiomove is called, the address space presently in context must
  * be the same as the one recorded in uio_space. This is an important
  * sanity check if I/O has been queued.
+ *
+ * Transfers of at least uio_loan_threshold bytes to or from a
+ * page-aligned user buffer are done a page at a time through the
+ * underlying page frames (see as_loanpage) instead of through
+ * copyin/copyout. Setting the threshold to 0 turns this off.
  */
 int uiomove(void *kbuffer, size_t len, struct uio *uio);
 
+#define UIO_LOAN_THRESHOLD  PAGE_SIZE	/* default uio_loan_threshold */
+extern size_t uio_loan_threshold;
+
 /*
  * Like uiomove, but sends zeros.
  */
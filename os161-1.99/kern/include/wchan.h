@@ -36,6 +36,13 @@
 
 
 struct wchan; /* Opaque */
+struct thread; /* from <thread.h> */
+
+/*
+ * Call once during system startup, before any wait channels are
+ * made, to set up the object cache they come from.
+ */
+void wchan_bootstrap(void);
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -81,5 +88,21 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake up one particular thread, which must be sleeping on the wait
+ * channel. Unlike the above, the channel must already be locked, and
+ * is still locked on return.
+ */
+void wchan_wakethread(struct wchan *wc, struct thread *target);
+
+/*
+ * Move up to MAX threads sleeping on FROM to TO, without waking them.
+ * FROM must be locked (and still is on return); TO must not be.
+ * If MOVED isn't NULL it's called on each thread moved, with DATA,
+ * while both channels are locked. Returns the number of threads moved.
+ */
+unsigned wchan_transfer(struct wchan *from, struct wchan *to, unsigned max,
+			void (*moved)(struct thread *, void *), void *data);
+
 
 #endif /* _WCHAN_H_ */
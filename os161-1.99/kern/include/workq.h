@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _WORKQ_H_
+#define _WORKQ_H_
+
+/*
+ * Deferred work.
+ *
+ * An interrupt handler should do only what has to be done with the
+ * device's attention: read its status, acknowledge it, copy out data
+ * that would otherwise be lost. Waking threads up and other completion
+ * processing can be handed off with work_queue(), which puts a work
+ * item on the current cpu's queue. Each cpu has a worker thread that
+ * runs queued items in order, with interrupts on.
+ *
+ * A work item is queued at most once at a time: queueing it again
+ * while it's still waiting is a no-op, so anything that happens N
+ * times between runs (e.g. timer ticks, input characters) has to be
+ * counted by the caller. An item that's running can be queued again
+ * and will run again afterwards. Work functions may sleep, but that
+ * holds up everything else queued on that cpu.
+ *
+ * Until the cpu's worker thread has been started, work_queue just
+ * calls the function directly.
+ */
+
+struct cpu; /* from <cpu.h> */
+
+struct work {
+	struct work *wk_next;		/* Next on the cpu's queue */
+	void (*wk_func)(void *data);	/* What to do */
+	void *wk_data;			/* Argument to wk_func */
+	volatile unsigned wk_queued;	/* Nonzero while on a queue */
+};
+
+/*
+ * Static initializer, for items that aren't embedded in something
+ * allocated at runtime.
+ */
+#define WORK_INITIALIZER(func, data)  { NULL, func, data, 0 }
+
+void work_init(struct work *wk, void (*func)(void *data), void *data);
+void work_queue(struct work *wk);
+
+/*
+ * Per-cpu setup. workq_initcpu fills in the queue in a new struct
+ * cpu; workq_start, called on the cpu itself once threads work,
+ * starts its worker thread.
+ */
+void workq_initcpu(struct cpu *c);
+void workq_start(void);
+
+
+#endif /* _WORKQ_H_ */
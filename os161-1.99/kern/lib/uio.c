@@ -28,16 +28,58 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
 #include <current.h>
+#include <addrspace.h>
 #include <copyinout.h>
 
 /*
  * See uio.h for a description.
  */
 
+size_t uio_loan_threshold = UIO_LOAN_THRESHOLD;
+
+/*
+ * Move SIZE bytes, a whole number of pages, between PTR and the
+ * page-aligned user buffer UBASE by borrowing the user page frames
+ * from the VM system and copying through their kernel addresses.
+ *
+ * This skips the copyin/copyout fault-recovery setup and, more to
+ * the point, doesn't take a TLB miss on every user page touched.
+ */
+static
+int
+uiomove_loan(void *ptr, size_t size, userptr_t ubase, struct uio *uio)
+{
+	vaddr_t uva, kva;
+	size_t done;
+	int result;
+
+	KASSERT(((vaddr_t)ubase & ~(vaddr_t)PAGE_FRAME) == 0);
+	KASSERT((size & ~(size_t)PAGE_FRAME) == 0);
+
+	for (done = 0; done < size; done += PAGE_SIZE) {
+		uva = (vaddr_t)ubase + done;
+		if (uva >= USERSPACETOP) {
+			return EFAULT;
+		}
+		result = as_loanpage(uio->uio_space, uva, &kva);
+		if (result) {
+			return result;
+		}
+		if (uio->uio_rw == UIO_READ) {
+			memmove((void *)kva, (char *)ptr + done, PAGE_SIZE);
+		}
+		else {
+			memmove((char *)ptr + done, (void *)kva, PAGE_SIZE);
+		}
+	}
+	return 0;
+}
+
 int
 uiomove(void *ptr, size_t n, struct uio *uio)
 {
@@ -93,7 +135,17 @@ uiomove(void *ptr, size_t n, struct uio *uio)
 			    break;
 		    case UIO_USERSPACE:
 		    case UIO_USERISPACE:
-			    if (uio->uio_rw == UIO_READ) {
+			    if (uio_loan_threshold > 0 &&
+				size >= uio_loan_threshold &&
+				size >= PAGE_SIZE &&
+				((vaddr_t)iov->iov_ubase & ~(vaddr_t)PAGE_FRAME)
+				== 0) {
+				    /* Whole pages only; the tail goes below. */
+				    size &= PAGE_FRAME;
+				    result = uiomove_loan(ptr, size,
+							  iov->iov_ubase, uio);
+			    }
+			    else if (uio->uio_rw == UIO_READ) {
 				    result = copyout(ptr, iov->iov_ubase,size);
 			    }
 			    else {
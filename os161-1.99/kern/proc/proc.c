@@ -38,17 +38,20 @@
  * things they point to. Rearrange this (and/or change it to be a
  * regular lock) as needed.
  *
- * Unless you're implementing multithreaded user processes, the only
- * process that will have more than one thread is the kernel process.
+ * User processes can have more than one thread; see the thread_*
+ * system calls in thread_syscalls.c and proc_exitthread below.
  */
 
 #include <types.h>
+#include <cpu.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <wchan.h>
+#include <kmem_cache.h>
 #include <kern/fcntl.h>  
 
 /*
@@ -56,6 +59,9 @@
  */
 struct proc *kproc;
 
+/* Where proc structures come from */
+static struct kmem_cache *proc_objcache;
+
 /*
  * Mechanism for making the kernel menu thread sleep while processes are running
  */
@@ -79,14 +85,21 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
+	unsigned i;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_objcache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_objcache, proc);
+		return NULL;
+	}
+	proc->p_tjoinwchan = wchan_create("thread_join");
+	if (proc->p_tjoinwchan == NULL) {
+		kfree(proc->p_name);
+		kmem_cache_free(proc_objcache, proc);
 		return NULL;
 	}
 
@@ -99,6 +112,18 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
+	/* user-level thread fields */
+	for (i=0; i<THREAD_MAX; i++) {
+		proc->p_tstate[i] = PT_FREE;
+		proc->p_tstatus[i] = 0;
+	}
+	proc->p_exiting = false;
+	proc->p_cpumask = CPUMASK_ALL;
+	proc->p_utime = 0;
+	proc->p_stime = 0;
+	proc->p_nvcsw = 0;
+	proc->p_nivcsw = 0;
+
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
@@ -163,11 +188,12 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
+	wchan_destroy(proc->p_tjoinwchan);
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_objcache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -193,6 +219,10 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+  proc_objcache = kmem_cache_create("proc", sizeof(struct proc), 0, NULL);
+  if (proc_objcache == NULL) {
+    panic("proc_bootstrap: Out of memory\n");
+  }
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -243,6 +273,9 @@ proc_create_runprogram(const char *name)
 
 	proc->p_addrspace = NULL;
 
+	/* the thread runprogram is called in becomes thread 0 */
+	proc->p_tstate[0] = PT_RUNNING;
+
 	/* VFS fields */
 
 #ifdef UW
@@ -287,6 +320,16 @@ proc_addthread(struct proc *proc, struct thread *t)
 
 	spinlock_acquire(&proc->p_lock);
 	result = threadarray_add(&proc->p_threads, t, NULL);
+	if (result == 0 && proc != kproc) {
+		/*
+		 * Take the process's cpu mask under p_lock, so that
+		 * sched_setaffinity either finds the thread in
+		 * p_threads or has already changed p_cpumask. Kernel
+		 * threads keep the mask thread_fork gave them; that's
+		 * how workq pins its workers.
+		 */
+		t->t_cpumask = proc->p_cpumask;
+	}
 	spinlock_release(&proc->p_lock);
 	if (result) {
 		return result;
@@ -297,9 +340,11 @@ proc_addthread(struct proc *proc, struct thread *t)
 
 /*
  * Remove a thread from its process. Either the thread or the process
- * might or might not be current.
+ * might or might not be current. Returns the number of threads still
+ * in the process; since this is computed under p_lock, exactly one
+ * caller sees zero.
  */
-void
+unsigned
 proc_remthread(struct thread *t)
 {
 	struct proc *proc;
@@ -314,9 +359,14 @@ proc_remthread(struct thread *t)
 	for (i=0; i<num; i++) {
 		if (threadarray_get(&proc->p_threads, i) == t) {
 			threadarray_remove(&proc->p_threads, i);
+			num = threadarray_num(&proc->p_threads);
+			proc->p_utime += t->t_utime;
+			proc->p_stime += t->t_stime;
+			proc->p_nvcsw += t->t_nvcsw;
+			proc->p_nivcsw += t->t_nivcsw;
 			spinlock_release(&proc->p_lock);
 			t->t_proc = NULL;
-			return;
+			return num;
 		}
 	}
 	/* Did not find it. */
@@ -324,6 +374,48 @@ proc_remthread(struct thread *t)
 	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
 }
 
+/*
+ * Detach the current thread from its (user) process and exit it.
+ *
+ * Used by _exit and thread_exit, and by threads that find p_exiting
+ * set on their way back to user mode. Whichever thread leaves last
+ * destroys the address space and the process; until then the others
+ * may still be running in it.
+ */
+void
+proc_exitthread(void)
+{
+	struct proc *p = curproc;
+	struct addrspace *as;
+
+	KASSERT(p != NULL);
+	KASSERT(p != kproc);
+
+	/* note: curproc cannot be used after this call */
+	if (proc_remthread(curthread) > 0) {
+		thread_exit();
+	}
+
+	/*
+	 * We were the last thread, so nobody else can be looking at
+	 * p any more. Clear p_addrspace before calling as_destroy, in
+	 * case as_destroy sleeps and we come back through as_activate.
+	 * (We're detached, so as_activate won't find it anyway.)
+	 */
+	as_deactivate();
+	as = p->p_addrspace;
+	p->p_addrspace = NULL;
+	if (as != NULL) {
+		as_destroy(as);
+	}
+
+	/* if this is the last user process in the system, proc_destroy()
+	   will wake up the kernel menu thread */
+	proc_destroy(p);
+
+	thread_exit();
+}
+
 /*
  * Fetch the address space of the current process. Caution: it isn't
  * refcounted. If you implement multithreaded processes, make sure to
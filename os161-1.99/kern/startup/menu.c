@@ -38,6 +38,7 @@
 #include <thread.h>
 #include <proc.h>
 #include <synch.h>
+#include <lockstat.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
@@ -45,6 +46,7 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -384,6 +386,25 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Command for setting the transfer size at which uiomove starts
+ * borrowing user page frames instead of using copyin/copyout.
+ */
+static
+int
+cmd_loanthresh(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: loan bytes (currently %lu; 0 disables)\n",
+			(unsigned long) uio_loan_threshold);
+		return EINVAL;
+	}
+
+	uio_loan_threshold = atoi(args[1]);
+
+	return 0;
+}
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -396,6 +417,121 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_LOCKSTAT
+/*
+ * Command for lock statistics.
+ *
+ * Usage: lockstat [n | reset]
+ * Print the N (default 10) most contended locks, or zero the counts.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	unsigned n;
+
+	if (nargs > 2) {
+		kprintf("Usage: lockstat [n | reset]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+		return 0;
+	}
+
+	n = 10;
+	if (nargs == 2) {
+		n = atoi(args[1]);
+	}
+	lockstat_print(n);
+	return 0;
+}
+#endif
+
+/*
+ * Command for setting how long after running a thread is treated as
+ * cache-hot by the load balancer.
+ */
+static
+int
+cmd_hotwindow(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: hot hardclocks (currently %u; 0 disables)\n",
+			thread_hot_hardclocks);
+		return EINVAL;
+	}
+
+	thread_hot_hardclocks = atoi(args[1]);
+
+	return 0;
+}
+
+/*
+ * Command for turning dynamic ticks on and off.
+ */
+static
+int
+cmd_dyntick(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: dyntick 0|1 (currently %d)\n",
+			hardclock_dynamic);
+		return EINVAL;
+	}
+
+	hardclock_dynamic = atoi(args[1]) != 0;
+
+	return 0;
+}
+
+static
+int
+cmd_threadcache(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	threadcache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_runqueues(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printrunqueues();
+
+	return 0;
+}
+
+/*
+ * Command for showing cpu utilization and the busiest threads.
+ */
+static
+int
+cmd_top(int nargs, char **args)
+{
+	unsigned ntop = 10;
+
+	if (nargs > 2) {
+		kprintf("Usage: top [nthreads]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		ntop = atoi(args[1]);
+	}
+
+	thread_printtop(ntop);
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -435,6 +571,9 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[loan]    Set uiomove loan threshold",
+	"[hot]     Set cache-hot window      ",
+	"[dyntick] Dynamic ticks on/off      ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -456,6 +595,8 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] Object cache test             ",
+	"[cb]  copyin/copyout benchmark      ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -465,6 +606,10 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[rw1] Reader-writer lock test       ",
+	"[rw2] Reader-writer lock benchmark  ",
+	"[spb] Spinlock contention benchmark ",
+	"[pi1] Priority inheritance test     ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -505,6 +650,12 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[rq] Run queue stats                ",
+	"[top] CPU usage by cpu and thread   ",
+	"[tc] Thread cache stats             ",
+#if OPT_LOCKSTAT
+	"[lockstat] Lock statistics          ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -545,6 +696,9 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "loan",	cmd_loanthresh },
+	{ "hot",	cmd_hotwindow },
+	{ "dyntick",	cmd_dyntick },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -561,12 +715,20 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "rq",		cmd_runqueues },
+	{ "top",	cmd_top },
+	{ "tc",		cmd_threadcache },
+#if OPT_LOCKSTAT
+	{ "lockstat",	cmd_lockstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	cachetest },
+	{ "cb",		copybench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -578,6 +740,10 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "rw1",	rwtest },
+	{ "rw2",	rwbench },
+	{ "spb",	spinbench },
+	{ "pi1",	pitest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
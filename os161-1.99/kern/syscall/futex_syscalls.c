@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <futex.h>
+#include <syscall.h>
+
+/*
+ * Futexes.
+ *
+ * A futex is just a word of user memory. FUTEX_WAIT puts the caller
+ * to sleep if the word still holds the value it expects; FUTEX_WAKE
+ * wakes sleepers on the word. User-level locks can then do the
+ * uncontended case with no system call at all, and only call into
+ * the kernel to sleep or to wake someone.
+ *
+ * The kernel side is a hash table, keyed by (address space, user
+ * address), of entries that each hold a wait channel. Entries exist
+ * only while some thread is sleeping (or about to sleep) on them; the
+ * last thread to leave one frees it.
+ *
+ * The check of the word and going to sleep must be atomic with
+ * respect to FUTEX_WAKE, so the word is read while holding the hash
+ * bucket's spinlock. We can't take a fault there, so we read it
+ * through the kernel mapping of its page frame (as_loanpage) instead
+ * of with copyin. That relies on the frame not moving while we look
+ * at it, which is true under dumbvm.
+ */
+
+/* Number of hash buckets; must be a power of 2. */
+#define FUTEX_HASHSIZE  64
+
+struct futex {
+	struct addrspace *fx_as;	/* address space of the word */
+	vaddr_t fx_addr;		/* user address of the word */
+	struct wchan *fx_wchan;		/* sleepers */
+	unsigned fx_waiters;		/* sleepers not yet woken */
+	unsigned fx_refs;		/* threads using this entry */
+	struct futex *fx_next;		/* hash chain */
+};
+
+struct futex_bucket {
+	struct spinlock fb_lock;
+	struct futex *fb_list;
+};
+
+static struct futex_bucket futex_table[FUTEX_HASHSIZE];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		spinlock_init(&futex_table[i].fb_lock);
+		futex_table[i].fb_list = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_hash(struct addrspace *as, vaddr_t addr)
+{
+	uint32_t h;
+
+	h = (addr >> 2) ^ ((uintptr_t)as >> 4);
+	h *= 0x9e3779b1;	/* mix the bits up (Fibonacci hashing) */
+	return &futex_table[(h >> 16) & (FUTEX_HASHSIZE - 1)];
+}
+
+/*
+ * Find the entry for (AS, ADDR) in bucket FB. Call with the bucket
+ * locked.
+ */
+static
+struct futex *
+futex_lookup(struct futex_bucket *fb, struct addrspace *as, vaddr_t addr)
+{
+	struct futex *fx;
+
+	KASSERT(spinlock_do_i_hold(&fb->fb_lock));
+
+	for (fx = fb->fb_list; fx != NULL; fx = fx->fx_next) {
+		if (fx->fx_as == as && fx->fx_addr == addr) {
+			return fx;
+		}
+	}
+	return NULL;
+}
+
+static
+struct futex *
+futex_create(struct addrspace *as, vaddr_t addr)
+{
+	struct futex *fx;
+
+	fx = kmalloc(sizeof(*fx));
+	if (fx == NULL) {
+		return NULL;
+	}
+	fx->fx_wchan = wchan_create("futex");
+	if (fx->fx_wchan == NULL) {
+		kfree(fx);
+		return NULL;
+	}
+	fx->fx_as = as;
+	fx->fx_addr = addr;
+	fx->fx_waiters = 0;
+	fx->fx_refs = 0;
+	fx->fx_next = NULL;
+	return fx;
+}
+
+static
+void
+futex_destroy(struct futex *fx)
+{
+	KASSERT(fx->fx_refs == 0);
+	KASSERT(fx->fx_waiters == 0);
+	wchan_destroy(fx->fx_wchan);
+	kfree(fx);
+}
+
+/*
+ * Drop a reference to FX, which is in bucket FB; if it was the last,
+ * unlink it and return it so the caller can destroy it once the
+ * bucket is unlocked. Otherwise return NULL.
+ */
+static
+struct futex *
+futex_unref(struct futex_bucket *fb, struct futex *fx)
+{
+	struct futex **pp;
+
+	KASSERT(spinlock_do_i_hold(&fb->fb_lock));
+	KASSERT(fx->fx_refs > 0);
+
+	fx->fx_refs--;
+	if (fx->fx_refs > 0) {
+		return NULL;
+	}
+	for (pp = &fb->fb_list; *pp != fx; pp = &(*pp)->fx_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = fx->fx_next;
+	return fx;
+}
+
+static
+int
+futex_wait(struct addrspace *as, vaddr_t addr, volatile int *word, int val)
+{
+	struct futex_bucket *fb;
+	struct futex *fx, *newfx = NULL;
+
+	fb = futex_hash(as, addr);
+
+	spinlock_acquire(&fb->fb_lock);
+	fx = futex_lookup(fb, as, addr);
+	if (fx == NULL) {
+		/*
+		 * Nobody is waiting here yet. Make an entry without
+		 * holding the lock, then look again, since someone
+		 * may have beaten us to it.
+		 */
+		spinlock_release(&fb->fb_lock);
+		newfx = futex_create(as, addr);
+		if (newfx == NULL) {
+			return ENOMEM;
+		}
+		spinlock_acquire(&fb->fb_lock);
+		fx = futex_lookup(fb, as, addr);
+	}
+
+	/*
+	 * Checking p_exiting under the bucket lock means that if _exit
+	 * is in progress, either we see it here or its call to
+	 * futex_wakeall_as will see us.
+	 */
+	if (*word != val || curproc->p_exiting) {
+		spinlock_release(&fb->fb_lock);
+		if (newfx != NULL) {
+			futex_destroy(newfx);
+		}
+		return curproc->p_exiting ? EINTR : EAGAIN;
+	}
+
+	if (fx == NULL) {
+		fx = newfx;
+		newfx = NULL;
+		fx->fx_next = fb->fb_list;
+		fb->fb_list = fx;
+	}
+	fx->fx_refs++;
+	fx->fx_waiters++;
+
+	/* take the wchan lock first so FUTEX_WAKE can't miss us */
+	wchan_lock(fx->fx_wchan);
+	spinlock_release(&fb->fb_lock);
+	if (newfx != NULL) {
+		futex_destroy(newfx);
+	}
+	wchan_sleep(fx->fx_wchan);
+
+	/* FUTEX_WAKE (or futex_wakeall_as) took us off fx_waiters */
+	spinlock_acquire(&fb->fb_lock);
+	fx = futex_unref(fb, fx);
+	spinlock_release(&fb->fb_lock);
+	if (fx != NULL) {
+		futex_destroy(fx);
+	}
+
+	return curproc->p_exiting ? EINTR : 0;
+}
+
+static
+int
+futex_wake(struct addrspace *as, vaddr_t addr, int val, int *retval)
+{
+	struct futex_bucket *fb;
+	struct futex *fx;
+	unsigned n;
+
+	if (val <= 0) {
+		*retval = 0;
+		return 0;
+	}
+
+	fb = futex_hash(as, addr);
+
+	spinlock_acquire(&fb->fb_lock);
+	fx = futex_lookup(fb, as, addr);
+	n = 0;
+	if (fx != NULL) {
+		while (n < (unsigned)val && fx->fx_waiters > 0) {
+			fx->fx_waiters--;
+			wchan_wakeone(fx->fx_wchan);
+			n++;
+		}
+	}
+	spinlock_release(&fb->fb_lock);
+
+	*retval = n;
+	return 0;
+}
+
+void
+futex_wakeall_as(struct addrspace *as)
+{
+	struct futex_bucket *fb;
+	struct futex *fx;
+	unsigned i;
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		fb = &futex_table[i];
+		spinlock_acquire(&fb->fb_lock);
+		for (fx = fb->fb_list; fx != NULL; fx = fx->fx_next) {
+			if (fx->fx_as == as && fx->fx_waiters > 0) {
+				fx->fx_waiters = 0;
+				wchan_wakeall(fx->fx_wchan);
+			}
+		}
+		spinlock_release(&fb->fb_lock);
+	}
+}
+
+/*
+ * futex: FUTEX_WAIT sleeps until woken if the int at UADDR equals
+ * VAL, and fails with EAGAIN at once if not. FUTEX_WAKE wakes up to
+ * VAL threads sleeping on UADDR and returns how many it woke.
+ */
+int
+sys_futex(userptr_t uaddr, int op, int val, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t addr, kva;
+	int result;
+
+	addr = (vaddr_t)uaddr;
+	if (addr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+	if (addr >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+
+	*retval = 0;
+	switch (op) {
+	    case FUTEX_WAIT:
+		result = as_loanpage(as, addr & PAGE_FRAME, &kva);
+		if (result) {
+			return result;
+		}
+		return futex_wait(as, addr,
+			(volatile int *)(kva + (addr & ~(vaddr_t)PAGE_FRAME)),
+			val);
+	    case FUTEX_WAKE:
+		return futex_wake(as, addr, val, retval);
+	}
+	return EINVAL;
+}
@@ -145,9 +145,67 @@ load_segment(struct addrspace *as, struct vnode *v,
 	return result;
 }
 
+/*
+ * Upper bound on the size of the program header table we are willing
+ * to read in one gulp. Real executables have a handful of phdrs; this
+ * is just to keep a corrupt e_phnum from making us kmalloc the world.
+ */
+#define ELF_MAXPHTAB  PAGE_SIZE
+
+/*
+ * Read the whole program header table in one go. Returns a kmalloc'd
+ * buffer in PHTAB that the caller must kfree.
+ */
+static
+int
+read_phdrs(struct vnode *v, const Elf_Ehdr *eh, char **phtab)
+{
+	struct iovec iov;
+	struct uio ku;
+	size_t len;
+	char *buf;
+	int result;
+
+	if (eh->e_phentsize < sizeof(Elf_Phdr)) {
+		return ENOEXEC;
+	}
+	len = (size_t)eh->e_phnum * eh->e_phentsize;
+	if (len > ELF_MAXPHTAB) {
+		kprintf("ELF: program header table too large\n");
+		return ENOEXEC;
+	}
+
+	buf = kmalloc(len);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	uio_kinit(&iov, &ku, buf, len, eh->e_phoff, UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result) {
+		kfree(buf);
+		return result;
+	}
+
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on phdr - file truncated?\n");
+		kfree(buf);
+		return ENOEXEC;
+	}
+
+	*phtab = buf;
+	return 0;
+}
+
 /*
  * Load an ELF executable user program into the current address space.
  *
+ * The segments are read in order of file offset rather than in phdr
+ * order, so that loading the image is one forward sweep over the file
+ * instead of seeking back and forth. (The linker usually emits them
+ * in that order anyway, but nothing requires it to.)
+ *
  * Returns the entry point (initial PC) for the program in ENTRYPOINT.
  */
 int
@@ -155,7 +213,9 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
-	int result, i;
+	Elf_Phdr *segs; /* PT_LOAD headers, sorted by file offset */
+	char *phtab;
+	int result, i, j, nsegs;
 	struct iovec iov;
 	struct uio ku;
 	struct addrspace *as;
@@ -203,12 +263,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	/*
-	 * Go through the list of segments and set up the address space.
-	 *
-	 * Ordinarily there will be one code segment, one read-only
-	 * data segment, and one data/bss segment, but there might
-	 * conceivably be more. You don't need to support such files
-	 * if it's unduly awkward to do so.
+	 * Fetch the whole program header table with one read, rather
+	 * than one read per entry per pass.
 	 *
 	 * Note that the expression eh.e_phoff + i*eh.e_phentsize is 
 	 * mandated by the ELF standard - we use sizeof(ph) to load,
@@ -217,20 +273,32 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	 * to find where the phdr starts.
 	 */
 
-	for (i=0; i<eh.e_phnum; i++) {
-		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
+	result = read_phdrs(v, &eh, &phtab);
+	if (result) {
+		return result;
+	}
 
-		result = VOP_READ(v, &ku);
-		if (result) {
-			return result;
-		}
+	segs = kmalloc(eh.e_phnum * sizeof(Elf_Phdr));
+	if (segs == NULL) {
+		kfree(phtab);
+		return ENOMEM;
+	}
 
-		if (ku.uio_resid != 0) {
-			/* short read; problem with executable? */
-			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
-		}
+	/*
+	 * Go through the list of segments and set up the address space.
+	 *
+	 * Ordinarily there will be one code segment, one read-only
+	 * data segment, and one data/bss segment, but there might
+	 * conceivably be more. You don't need to support such files
+	 * if it's unduly awkward to do so.
+	 *
+	 * While we're at it, collect the loadable segments, insertion
+	 * sorted by file offset. There are only ever a few.
+	 */
+
+	nsegs = 0;
+	for (i=0; i<eh.e_phnum; i++) {
+		memcpy(&ph, phtab + i*eh.e_phentsize, sizeof(ph));
 
 		switch (ph.p_type) {
 		    case PT_NULL: /* skip */ continue;
@@ -240,7 +308,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		    default:
 			kprintf("loadelf: unknown segment type %d\n", 
 				ph.p_type);
-			return ENOEXEC;
+			result = ENOEXEC;
+			goto fail;
 		}
 
 		result = as_define_region(as,
@@ -249,53 +318,38 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 					  ph.p_flags & PF_W,
 					  ph.p_flags & PF_X);
 		if (result) {
-			return result;
+			goto fail;
 		}
+
+		for (j=nsegs; j>0 && segs[j-1].p_offset > ph.p_offset; j--) {
+			segs[j] = segs[j-1];
+		}
+		segs[j] = ph;
+		nsegs++;
 	}
 
 	result = as_prepare_load(as);
 	if (result) {
-		return result;
+		goto fail;
 	}
 
 	/*
 	 * Now actually load each segment.
 	 */
 
-	for (i=0; i<eh.e_phnum; i++) {
-		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
-
-		result = VOP_READ(v, &ku);
-		if (result) {
-			return result;
-		}
-
-		if (ku.uio_resid != 0) {
-			/* short read; problem with executable? */
-			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
-		}
-
-		switch (ph.p_type) {
-		    case PT_NULL: /* skip */ continue;
-		    case PT_PHDR: /* skip */ continue;
-		    case PT_MIPS_REGINFO: /* skip */ continue;
-		    case PT_LOAD: break;
-		    default:
-			kprintf("loadelf: unknown segment type %d\n", 
-				ph.p_type);
-			return ENOEXEC;
-		}
-
-		result = load_segment(as, v, ph.p_offset, ph.p_vaddr, 
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
+	for (i=0; i<nsegs; i++) {
+		result = load_segment(as, v, segs[i].p_offset,
+				      segs[i].p_vaddr, 
+				      segs[i].p_memsz, segs[i].p_filesz,
+				      segs[i].p_flags & PF_X);
 		if (result) {
-			return result;
+			goto fail;
 		}
 	}
 
+	kfree(segs);
+	kfree(phtab);
+
 	result = as_complete_load(as);
 	if (result) {
 		return result;
@@ -304,4 +358,9 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	*entrypoint = eh.e_entry;
 
 	return 0;
+
+ fail:
+	kfree(segs);
+	kfree(phtab);
+	return result;
 }
@@ -7,7 +7,10 @@
 #include <current.h>
 #include <proc.h>
 #include <thread.h>
+#include <cpu.h>
 #include <addrspace.h>
+#include <wchan.h>
+#include <futex.h>
 #include <copyinout.h>
 
   /* this implementation of sys__exit does not do anything with the exit code */
@@ -15,8 +18,8 @@
 
 void sys__exit(int exitcode) {
 
-  struct addrspace *as;
   struct proc *p = curproc;
+  bool others;
   /* for now, just include this to keep the compiler from complaining about
      an unused variable */
   (void)exitcode;
@@ -24,28 +27,28 @@ void sys__exit(int exitcode) {
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
   KASSERT(curproc->p_addrspace != NULL);
-  as_deactivate();
+
   /*
-   * clear p_addrspace before calling as_destroy. Otherwise if
-   * as_destroy sleeps (which is quite possible) when we
-   * come back we'll be calling as_activate on a
-   * half-destroyed address space. This tends to be
-   * messily fatal.
+   * Tell any other threads in the process to leave. Threads running
+   * in user mode notice at their next trap or syscall; threads
+   * asleep in thread_join or futex waits are woken up so they can
+   * notice too.
    */
-  as = curproc_setas(NULL);
-  as_destroy(as);
-
-  /* detach this thread from its process */
-  /* note: curproc cannot be used after this call */
-  proc_remthread(curthread);
+  spinlock_acquire(&p->p_lock);
+  p->p_exiting = true;
+  others = threadarray_num(&p->p_threads) > 1;
+  spinlock_release(&p->p_lock);
+  wchan_wakeall(p->p_tjoinwchan);
+  futex_wakeall_as(p->p_addrspace);
+  if (others) {
+    /* a cpu running one thread may have stopped its timer; poke it */
+    ipi_broadcast(IPI_UNIDLE);
+  }
 
-  /* if this is the last user process in the system, proc_destroy()
-     will wake up the kernel menu thread */
-  proc_destroy(p);
-  
-  thread_exit();
-  /* thread_exit() does not return, so we should never get here */
-  panic("return from thread_exit in sys_exit\n");
+  /* the last thread out destroys the address space and the process */
+  proc_exitthread();
+  /* proc_exitthread() does not return, so we should never get here */
+  panic("return from proc_exitthread in sys_exit\n");
 }
 
 
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * CPU affinity.
+ *
+ * The mask is a word with bit N standing for cpu N. It's kept in the
+ * process (p_cpumask) and in each of its threads (t_cpumask); the
+ * scheduler only looks at the thread's. Setting it sets every thread
+ * in the process. The caller moves off a cpu it's no longer allowed
+ * on before returning; other threads move as they get rescheduled.
+ *
+ * There's only one process anyone can name so far, the caller: PID
+ * must be 0 or the caller's own pid, or we fail with ESRCH.
+ */
+
+static
+int
+sched_checkpid(pid_t pid)
+{
+	pid_t mypid;
+	int result;
+
+	if (pid == 0) {
+		return 0;
+	}
+	result = sys_getpid(&mypid);
+	if (result) {
+		return result;
+	}
+	return pid == mypid ? 0 : ESRCH;
+}
+
+int
+sys_sched_setaffinity(pid_t pid, userptr_t umask)
+{
+	struct proc *p = curproc;
+	struct thread *t;
+	uint32_t mask;
+	unsigned i, num;
+	int result;
+
+	result = sched_checkpid(pid);
+	if (result) {
+		return result;
+	}
+	result = copyin(umask, &mask, sizeof(mask));
+	if (result) {
+		return result;
+	}
+	mask &= cpu_presentmask();
+	if (mask == 0) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&p->p_lock);
+	p->p_cpumask = mask;
+	num = threadarray_num(&p->p_threads);
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&p->p_threads, i);
+		if (t != curthread) {
+			result = thread_setcpumask(t, mask);
+			KASSERT(result == 0);
+		}
+	}
+	spinlock_release(&p->p_lock);
+
+	/* This may sleep, so do it without p_lock. */
+	return thread_setcpumask(curthread, mask);
+}
+
+int
+sys_sched_getaffinity(pid_t pid, userptr_t umask)
+{
+	struct proc *p = curproc;
+	uint32_t mask;
+	int result;
+
+	result = sched_checkpid(pid);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&p->p_lock);
+	mask = p->p_cpumask & cpu_presentmask();
+	spinlock_release(&p->p_lock);
+
+	return copyout(&mask, umask, sizeof(mask));
+}
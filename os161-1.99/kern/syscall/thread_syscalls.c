@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <limits.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * Multithreaded user processes.
+ *
+ * Each user thread is an ordinary kernel thread attached to the
+ * process, so it shares the address space, and gets its own user
+ * stack from as_define_threadstack. Threads are named by small
+ * integer ids that index p_tstate/p_tstatus in the process; the
+ * initial thread is id 0. A thread that exits stays PT_ZOMBIE until
+ * someone joins it, and only then can its id (and its user stack) be
+ * reused.
+ *
+ * Userlevel doesn't call __thread_create directly: libc's
+ * thread_create passes a start routine that calls the thread function
+ * and then thread_exit with its return value.
+ */
+
+/* Everything the new thread needs to get to user mode. */
+struct uthread_args {
+	vaddr_t ua_start;	/* libc start routine */
+	vaddr_t ua_func;	/* thread function, first arg to start */
+	vaddr_t ua_arg;		/* its argument, second arg to start */
+	vaddr_t ua_stack;	/* initial stack pointer */
+};
+
+/*
+ * Give a thread id back after a failed create.
+ */
+static
+void
+uthread_release(struct proc *p, unsigned tid)
+{
+	spinlock_acquire(&p->p_lock);
+	KASSERT(p->p_tstate[tid] == PT_RUNNING);
+	p->p_tstate[tid] = PT_FREE;
+	spinlock_release(&p->p_lock);
+}
+
+/*
+ * Entry point of a new user thread (via thread_fork).
+ */
+static
+void
+uthread_start(void *data1, unsigned long data2)
+{
+	struct uthread_args *ua = data1;
+	struct uthread_args args;
+
+	curthread->t_tid = data2;
+	args = *ua;
+	kfree(ua);
+
+	/*
+	 * enter_new_process puts its argc/argv arguments in a0/a1,
+	 * which is exactly where start(func, arg) wants them.
+	 */
+	enter_new_process((int)args.ua_func, (userptr_t)args.ua_arg,
+			  args.ua_stack, args.ua_start);
+
+	/* enter_new_process does not return. */
+	panic("enter_new_process returned\n");
+}
+
+/*
+ * __thread_create: start a new thread in the current process running
+ * START(FUNC, ARG) on a fresh user stack. Returns the new thread id.
+ */
+int
+sys___thread_create(userptr_t start, userptr_t func, userptr_t arg,
+		    int *retval)
+{
+	struct proc *p = curproc;
+	struct uthread_args *ua;
+	unsigned tid;
+	int result;
+
+	/* pick a free thread id */
+	spinlock_acquire(&p->p_lock);
+	for (tid=1; tid<THREAD_MAX; tid++) {
+		if (p->p_tstate[tid] == PT_FREE) {
+			break;
+		}
+	}
+	if (tid == THREAD_MAX) {
+		spinlock_release(&p->p_lock);
+		return EAGAIN;
+	}
+	p->p_tstate[tid] = PT_RUNNING;
+	p->p_tstatus[tid] = 0;
+	spinlock_release(&p->p_lock);
+
+	ua = kmalloc(sizeof(*ua));
+	if (ua == NULL) {
+		uthread_release(p, tid);
+		return ENOMEM;
+	}
+	ua->ua_start = (vaddr_t)start;
+	ua->ua_func = (vaddr_t)func;
+	ua->ua_arg = (vaddr_t)arg;
+
+	result = as_define_threadstack(curproc_getas(), tid, &ua->ua_stack);
+	if (result) {
+		kfree(ua);
+		uthread_release(p, tid);
+		return result;
+	}
+
+	result = thread_fork(curthread->t_name, p, uthread_start, ua, tid);
+	if (result) {
+		kfree(ua);
+		uthread_release(p, tid);
+		return result;
+	}
+
+	*retval = tid;
+	return 0;
+}
+
+/*
+ * thread_join: wait for thread TID of the current process to exit,
+ * store its exit code through STATUS (if not null), and free its id.
+ */
+int
+sys_thread_join(int tid, userptr_t status)
+{
+	struct proc *p = curproc;
+	int exitcode;
+
+	if (tid < 0 || tid >= THREAD_MAX) {
+		return EINVAL;
+	}
+	if ((unsigned)tid == curthread->t_tid) {
+		/* would wait forever */
+		return EINVAL;
+	}
+
+	spinlock_acquire(&p->p_lock);
+	while (p->p_tstate[tid] == PT_RUNNING && !p->p_exiting) {
+		/* take the wchan lock first so the wakeup can't be missed */
+		wchan_lock(p->p_tjoinwchan);
+		spinlock_release(&p->p_lock);
+		wchan_sleep(p->p_tjoinwchan);
+		spinlock_acquire(&p->p_lock);
+	}
+	if (p->p_tstate[tid] != PT_ZOMBIE) {
+		/* never existed, already joined, or we're going away */
+		spinlock_release(&p->p_lock);
+		return p->p_exiting ? EINTR : ESRCH;
+	}
+	exitcode = p->p_tstatus[tid];
+	p->p_tstate[tid] = PT_FREE;
+	spinlock_release(&p->p_lock);
+
+	if (status != NULL) {
+		return copyout(&exitcode, status, sizeof(int));
+	}
+	return 0;
+}
+
+/*
+ * thread_exit: end the calling thread, leaving EXITCODE for
+ * thread_join. If this is the last thread the process goes away.
+ */
+void
+sys_thread_exit(int exitcode)
+{
+	struct proc *p = curproc;
+
+	spinlock_acquire(&p->p_lock);
+	KASSERT(p->p_tstate[curthread->t_tid] == PT_RUNNING);
+	p->p_tstate[curthread->t_tid] = PT_ZOMBIE;
+	p->p_tstatus[curthread->t_tid] = exitcode;
+	spinlock_release(&p->p_lock);
+	wchan_wakeall(p->p_tjoinwchan);
+
+	proc_exitthread();
+	/* proc_exitthread() does not return, so we should never get here */
+	panic("return from proc_exitthread in sys_thread_exit\n");
+}
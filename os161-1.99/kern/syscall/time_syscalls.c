@@ -28,7 +28,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/resource.h>
+#include <lib.h>
+#include <spl.h>
 #include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
 #include <copyinout.h>
 #include <syscall.h>
 
@@ -56,3 +63,68 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Convert a count of clock_cycles() to a timeval.
+ */
+static
+void
+cycles_to_timeval(uint64_t cycles, struct timeval *tv)
+{
+	uint64_t usec;
+
+	usec = clock_cycles_usec(cycles);
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+}
+
+/*
+ * getrusage: report the CPU time and context switches of the calling
+ * process's threads, live and exited. The other fields aren't kept,
+ * and are zero. There is no fork, so there are never any children to
+ * report on.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+	struct proc *p = curproc;
+	struct thread *t;
+	struct rusage ru;
+	uint64_t utime, stime;
+	unsigned i, num;
+	int spl;
+
+	bzero(&ru, sizeof(ru));
+	switch (who) {
+	    case RUSAGE_SELF:
+		/* Bring our own time up to date. */
+		spl = splhigh();
+		thread_charge(false);
+		splx(spl);
+
+		spinlock_acquire(&p->p_lock);
+		utime = p->p_utime;
+		stime = p->p_stime;
+		ru.ru_nvcsw = p->p_nvcsw;
+		ru.ru_nivcsw = p->p_nivcsw;
+		num = threadarray_num(&p->p_threads);
+		for (i=0; i<num; i++) {
+			t = threadarray_get(&p->p_threads, i);
+			utime += t->t_utime;
+			stime += t->t_stime;
+			ru.ru_nvcsw += t->t_nvcsw;
+			ru.ru_nivcsw += t->t_nivcsw;
+		}
+		spinlock_release(&p->p_lock);
+
+		cycles_to_timeval(utime, &ru.ru_utime);
+		cycles_to_timeval(stime, &ru.ru_stime);
+		break;
+	    case RUSAGE_CHILDREN:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	return copyout(&ru, usage, sizeof(ru));
+}
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test and benchmark code for copyin/copyout.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <setjmp.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <test.h>
+
+/*
+ * copybench builds a scratch user address space for the menu thread,
+ * checks that copyin/copyout/copyinstr move data correctly and fail
+ * cleanly on bad addresses, and then times copies of several sizes.
+ *
+ * For comparison it also times the scheme copyinout.c used to use,
+ * which set tm_badfaultfunc and did a setjmp() before every memcpy.
+ * That version is reproduced here as oldcopyin/oldcopyout.
+ */
+
+#define NITERS     2000
+#define REGION1    0x00400000
+#define REGION2    0x10000000
+#define BADADDR    ((userptr_t)0x1000)	/* not in any region */
+
+static const size_t copysizes[] = { 4, 64, 512, PAGE_SIZE };
+#define NCOPYSIZES (sizeof(copysizes) / sizeof(copysizes[0]))
+
+static char kbuf[PAGE_SIZE];
+static char kbuf2[PAGE_SIZE];
+
+static jmp_buf oldcopy_jmp;
+
+static
+void
+oldcopy_fail(void)
+{
+	longjmp(oldcopy_jmp, 1);
+}
+
+static
+int
+oldcopyin(const_userptr_t usersrc, void *dest, size_t len)
+{
+	curthread->t_machdep.tm_badfaultfunc = oldcopy_fail;
+	if (setjmp(oldcopy_jmp)) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		return EFAULT;
+	}
+	memcpy(dest, (const void *)usersrc, len);
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+	return 0;
+}
+
+static
+int
+oldcopyout(const void *src, userptr_t userdest, size_t len)
+{
+	curthread->t_machdep.tm_badfaultfunc = oldcopy_fail;
+	if (setjmp(oldcopy_jmp)) {
+		curthread->t_machdep.tm_badfaultfunc = NULL;
+		return EFAULT;
+	}
+	memcpy((void *)userdest, src, len);
+	curthread->t_machdep.tm_badfaultfunc = NULL;
+	return 0;
+}
+
+/*
+ * Set up an address space with two small regions and a stack, and
+ * make it current. Returns the old address space through OLDAS.
+ */
+static
+int
+copybench_setup(struct addrspace **oldas, vaddr_t *stackptr)
+{
+	struct addrspace *as;
+	int result;
+
+	as = as_create();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	result = as_define_region(as, REGION1, PAGE_SIZE, 1, 1, 0);
+	if (result == 0) {
+		result = as_define_region(as, REGION2, PAGE_SIZE, 1, 1, 0);
+	}
+	if (result == 0) {
+		result = as_prepare_load(as);
+	}
+	if (result == 0) {
+		result = as_complete_load(as);
+	}
+	if (result == 0) {
+		result = as_define_stack(as, stackptr);
+	}
+	if (result) {
+		as_destroy(as);
+		return result;
+	}
+
+	*oldas = curproc_setas(as);
+	as_activate();
+	return 0;
+}
+
+static
+void
+copybench_cleanup(struct addrspace *oldas)
+{
+	struct addrspace *as;
+
+	as = curproc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+}
+
+/*
+ * Check that data makes it through copyout/copyin intact, that string
+ * copies stop at the right place, and that bad addresses give EFAULT.
+ */
+static
+int
+copybench_check(userptr_t ubuf)
+{
+	size_t i, j, len, got;
+	int result;
+
+	for (i=0; i<NCOPYSIZES; i++) {
+		len = copysizes[i];
+		for (j=0; j<len; j++) {
+			kbuf[j] = (char)(i + j);
+		}
+		bzero(kbuf2, len);
+		/* odd offset exercises the unaligned path */
+		result = copyout(kbuf, ubuf + (i & 1), len);
+		if (result == 0) {
+			result = copyin(ubuf + (i & 1), kbuf2, len);
+		}
+		if (result) {
+			kprintf("copybench: %lu-byte copy: %s\n",
+				(unsigned long)len, strerror(result));
+			return result;
+		}
+		for (j=0; j<len; j++) {
+			if (kbuf[j] != kbuf2[j]) {
+				kprintf("copybench: %lu-byte copy: data "
+					"mismatch at %lu\n",
+					(unsigned long)len, (unsigned long)j);
+				return EINVAL;
+			}
+		}
+	}
+
+	strcpy(kbuf, "spinach");
+	result = copyoutstr(kbuf, ubuf, sizeof(kbuf), &got);
+	if (result == 0 && got != strlen("spinach") + 1) {
+		result = EINVAL;
+	}
+	if (result == 0) {
+		result = copyinstr(ubuf, kbuf2, 4, &got);
+		result = (result == ENAMETOOLONG) ? 0 : EINVAL;
+	}
+	if (result) {
+		kprintf("copybench: string copy failed\n");
+		return result;
+	}
+
+	if (copyin(BADADDR, kbuf, 16) != EFAULT ||
+	    copyout(kbuf, BADADDR, 16) != EFAULT ||
+	    copyinstr(BADADDR, kbuf, 16, NULL) != EFAULT) {
+		kprintf("copybench: bad address did not give EFAULT\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+static
+void
+copybench_report(const char *what, size_t len,
+		 time_t s1, uint32_t ns1, time_t s2, uint32_t ns2)
+{
+	time_t secs;
+	uint32_t nsecs;
+	uint64_t total;
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	total = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("%-8s %5lu bytes: %6lu ns/copy\n", what, (unsigned long)len,
+		(unsigned long)(total / NITERS));
+}
+
+static
+void
+copybench_time(userptr_t ubuf)
+{
+	time_t s1, s2;
+	uint32_t ns1, ns2;
+	size_t i, len;
+	int j;
+
+	for (i=0; i<NCOPYSIZES; i++) {
+		len = copysizes[i];
+
+		gettime(&s1, &ns1);
+		for (j=0; j<NITERS; j++) {
+			oldcopyin(ubuf, kbuf, len);
+		}
+		gettime(&s2, &ns2);
+		copybench_report("old in", len, s1, ns1, s2, ns2);
+
+		gettime(&s1, &ns1);
+		for (j=0; j<NITERS; j++) {
+			copyin(ubuf, kbuf, len);
+		}
+		gettime(&s2, &ns2);
+		copybench_report("copyin", len, s1, ns1, s2, ns2);
+
+		gettime(&s1, &ns1);
+		for (j=0; j<NITERS; j++) {
+			oldcopyout(kbuf, ubuf, len);
+		}
+		gettime(&s2, &ns2);
+		copybench_report("old out", len, s1, ns1, s2, ns2);
+
+		gettime(&s1, &ns1);
+		for (j=0; j<NITERS; j++) {
+			copyout(kbuf, ubuf, len);
+		}
+		gettime(&s2, &ns2);
+		copybench_report("copyout", len, s1, ns1, s2, ns2);
+	}
+}
+
+int
+copybench(int nargs, char **args)
+{
+	struct addrspace *oldas;
+	vaddr_t stackptr;
+	userptr_t ubuf;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	result = copybench_setup(&oldas, &stackptr);
+	if (result) {
+		kprintf("copybench: cannot set up address space: %s\n",
+			strerror(result));
+		return result;
+	}
+
+	/* use the page-aligned area two pages below the stack top */
+	ubuf = (userptr_t)(stackptr - 2*PAGE_SIZE);
+
+	result = copybench_check(ubuf);
+	if (result == 0) {
+		copybench_time(ubuf);
+		kprintf("copybench done.\n");
+	}
+
+	copybench_cleanup(oldas);
+	return result;
+}
@@ -31,9 +31,11 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <kmem_cache.h>
 #include <test.h>
 
 /*
@@ -137,3 +139,156 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Test object caches: NTHREADS threads each allocate and free objects
+ * of an odd size from one cache, keeping CACHEKEEP at a time. Each
+ * object is constructed with a magic number and must be freed with it
+ * intact; while held, it's filled with the owner's number, and checked
+ * before it's freed, to catch objects handed out twice and the cache
+ * scribbling on objects in use (e.g. with its free link).
+ */
+
+#define CACHETRIES	2000
+#define CACHEKEEP	40
+#define CACHEOBJSIZE	520
+#define CACHEMAGIC	0xcafe1234
+
+struct cacheobj {
+	uint32_t co_magic;
+	uint32_t co_owner;
+	char co_fill[CACHEOBJSIZE - 2*sizeof(uint32_t)];
+};
+
+static struct kmem_cache *testcache;
+static volatile unsigned cachectors;
+
+static
+void
+cacheobj_ctor(void *obj)
+{
+	struct cacheobj *co = obj;
+
+	co->co_magic = CACHEMAGIC;
+	co->co_owner = 0;
+	cachectors++;
+}
+
+/*
+ * Check that an object we hold still has our number all through it,
+ * and put it back in constructed state for freeing.
+ */
+static
+void
+cacheobj_release(struct cacheobj *co, unsigned long num)
+{
+	unsigned i;
+
+	if (co->co_owner != num + 1) {
+		panic("cachetest: object %p stolen by %u\n",
+		      co, co->co_owner);
+	}
+	for (i=0; i<sizeof(co->co_fill); i++) {
+		if (co->co_fill[i] != (char)(num + 1)) {
+			panic("cachetest: object %p overwritten at "
+			      "byte %u\n", co, i);
+		}
+	}
+	co->co_owner = 0;
+}
+
+static
+void
+cachethread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	struct cacheobj *held[CACHEKEEP];
+	struct cacheobj *co;
+	unsigned i, j, k;
+
+	for (j=0; j<CACHEKEEP; j++) {
+		held[j] = NULL;
+	}
+	for (i=0; i<CACHETRIES; i++) {
+		j = i % CACHEKEEP;
+		if (held[j] != NULL) {
+			co = held[j];
+			cacheobj_release(co, num);
+			kmem_cache_free(testcache, co);
+		}
+		co = kmem_cache_alloc(testcache);
+		if (co == NULL) {
+			kprintf("thread %lu: kmem_cache_alloc returned "
+				"NULL\n", num);
+			held[j] = NULL;
+			break;
+		}
+		if (co->co_magic != CACHEMAGIC || co->co_owner != 0) {
+			panic("cachetest: object %p not in constructed "
+			      "state\n", co);
+		}
+		if ((vaddr_t)co % 8 != 0) {
+			panic("cachetest: object %p misaligned\n", co);
+		}
+		co->co_owner = num + 1;
+		for (k=0; k<sizeof(co->co_fill); k++) {
+			co->co_fill[k] = num + 1;
+		}
+		held[j] = co;
+	}
+	for (j=0; j<CACHEKEEP; j++) {
+		if (held[j] != NULL) {
+			cacheobj_release(held[j], num);
+			kmem_cache_free(testcache, held[j]);
+		}
+	}
+	V(sem);
+}
+
+int
+cachetest(int nargs, char **args)
+{
+	struct semaphore *sem;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	testcache = kmem_cache_create("cachetest", sizeof(struct cacheobj),
+				      0, cacheobj_ctor);
+	if (testcache == NULL) {
+		return ENOMEM;
+	}
+	sem = sem_create("cachetest", 0);
+	if (sem == NULL) {
+		kmem_cache_destroy(testcache);
+		return ENOMEM;
+	}
+	cachectors = 0;
+
+	kprintf("Starting object cache test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("cachetest", NULL,
+				     cachethread, sem, i);
+		if (result) {
+			panic("cachetest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+
+	kheap_printstats();
+	kprintf("%u objects constructed for %u allocations\n",
+		cachectors, NTHREADS * CACHETRIES);
+
+	sem_destroy(sem);
+	kmem_cache_destroy(testcache);
+	testcache = NULL;
+	kprintf("Object cache test done\n");
+
+	return 0;
+}
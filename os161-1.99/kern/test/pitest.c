@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Priority inheritance test.
+ *
+ * A low-priority thread takes a lock and then has a fair amount of
+ * work to do before it lets go. Meanwhile a crowd of CPU hogs keeps
+ * every CPU busy, and a high-priority thread comes along and wants the
+ * lock. Without inheritance the holder has to compete with the hogs
+ * for CPU time and the high thread waits a long while; with it, the
+ * holder runs at the high thread's level until it releases.
+ *
+ * Priorities here are the scheduler's feedback levels, so "low" just
+ * means the holder and the hogs have been running long enough to sink,
+ * and "high" is a freshly forked thread that hasn't. We run the
+ * scenario with inheritance off and then on, and report how long the
+ * high thread waited and the best level the holder ran at.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+#define PINHOGS		8		/* CPU hogs */
+#define PIWARMUP	2000000		/* Holder's work before locking */
+#define PIWORK		2000000		/* Holder's work inside the lock */
+#define PICHUNK		1000		/* Check our level this often */
+
+static struct lock *pilock;
+static struct semaphore *piheld;
+static struct semaphore *pidone;
+static volatile bool pistop;
+static volatile unsigned pibestlevel;
+static volatile bool pileftover;
+static time_t piwaitsecs;
+static uint32_t piwaitnsecs;
+
+static
+void
+piwork(unsigned long n)
+{
+	volatile unsigned long i;
+
+	for (i = 0; i < n; i++);
+}
+
+static
+void
+pilow(void *junk, unsigned long num)
+{
+	unsigned long done;
+	unsigned level;
+
+	(void)junk;
+	(void)num;
+
+	piwork(PIWARMUP);
+
+	lock_acquire(pilock);
+	V(piheld);
+	for (done = 0; done < PIWORK; done += PICHUNK) {
+		piwork(PICHUNK);
+		level = thread_effpriority(curthread);
+		if (level < pibestlevel) {
+			pibestlevel = level;
+		}
+	}
+	lock_release(pilock);
+
+	/* Whatever we inherited should be gone now. */
+	if (curthread->t_inherited != SCHED_NLEVELS) {
+		pileftover = true;
+	}
+	V(pidone);
+}
+
+static
+void
+pihog(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	while (!pistop) {
+		piwork(PICHUNK);
+	}
+	V(pidone);
+}
+
+static
+void
+pihigh(void *junk, unsigned long num)
+{
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+
+	(void)junk;
+	(void)num;
+
+	gettime(&s1, &ns1);
+	lock_acquire(pilock);
+	gettime(&s2, &ns2);
+	lock_release(pilock);
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	piwaitsecs = secs;
+	piwaitnsecs = nsecs;
+	pistop = true;
+	V(pidone);
+}
+
+static
+void
+pitest_fork(const char *name, void (*func)(void *, unsigned long))
+{
+	int result;
+
+	result = thread_fork(name, NULL, func, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+}
+
+static
+void
+pitest_run(bool inherit)
+{
+	unsigned i;
+
+	lock_priority_inheritance = inherit;
+	pistop = false;
+	pibestlevel = SCHED_NLEVELS;
+	pileftover = false;
+	piwaitsecs = 0;
+	piwaitnsecs = 0;
+
+	for (i=0; i<PINHOGS; i++) {
+		pitest_fork("pihog", pihog);
+	}
+	pitest_fork("pilow", pilow);
+	P(piheld);
+	pitest_fork("pihigh", pihigh);
+
+	for (i=0; i<PINHOGS+2; i++) {
+		P(pidone);
+	}
+
+	kprintf("inheritance %-3s: high thread waited %lu.%09lu seconds, "
+		"holder's best level %u\n", inherit ? "on" : "off",
+		(unsigned long)piwaitsecs, (unsigned long)piwaitnsecs,
+		pibestlevel);
+	if (pileftover) {
+		kprintf("pitest: holder kept an inherited level after "
+			"releasing the lock\n");
+	}
+}
+
+int
+pitest(int nargs, char **args)
+{
+	bool saved;
+
+	(void)nargs;
+	(void)args;
+
+	pilock = lock_create("pitest");
+	if (pilock == NULL) {
+		return ENOMEM;
+	}
+	piheld = sem_create("piheld", 0);
+	if (piheld == NULL) {
+		lock_destroy(pilock);
+		return ENOMEM;
+	}
+	pidone = sem_create("pidone", 0);
+	if (pidone == NULL) {
+		sem_destroy(piheld);
+		lock_destroy(pilock);
+		return ENOMEM;
+	}
+
+	kprintf("Starting priority inheritance test...\n");
+	saved = lock_priority_inheritance;
+	pitest_run(false);
+	pitest_run(true);
+	lock_priority_inheritance = saved;
+
+	sem_destroy(pidone);
+	sem_destroy(piheld);
+	lock_destroy(pilock);
+	kprintf("Priority inheritance test done.\n");
+	return 0;
+}
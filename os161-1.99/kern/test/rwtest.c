@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Reader-writer lock tests.
+ *
+ * rwtest is a stress test: a crowd of threads take the lock at random
+ * for reading or writing (sometimes upgrading or downgrading) and
+ * check that no writer is ever inside alongside anybody else.
+ *
+ * rwbench times read-side acquire/release with increasing numbers of
+ * threads, against a plain lock doing the same thing, to show how
+ * readers scale across CPUs.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <atomic.h>
+#include <test.h>
+
+#define NRWLOOPS	200
+#define NRWTHREADS	24
+#define NBENCHLOOPS	5000
+#define MAXBENCHTHREADS	32
+
+static struct rwlock *testrw;
+static struct lock *benchlock;
+static struct semaphore *rwdonesem;
+static volatile unsigned readers_in;
+static volatile unsigned writers_in;
+static volatile unsigned long rwtestval;
+static volatile bool rwtest_failed;
+
+static
+int
+rwtest_setup(void)
+{
+	testrw = rwlock_create("rwtest");
+	if (testrw == NULL) {
+		return ENOMEM;
+	}
+	rwdonesem = sem_create("rwdonesem", 0);
+	if (rwdonesem == NULL) {
+		rwlock_destroy(testrw);
+		return ENOMEM;
+	}
+	readers_in = writers_in = 0;
+	rwtestval = 0;
+	rwtest_failed = false;
+	return 0;
+}
+
+static
+void
+rwtest_cleanup(void)
+{
+	sem_destroy(rwdonesem);
+	rwlock_destroy(testrw);
+}
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s (readers %u, writers %u)\n", num, msg,
+		readers_in, writers_in);
+	rwtest_failed = true;
+}
+
+/*
+ * Hang around inside the lock for a bit so that others pile up.
+ */
+static
+void
+rwtest_dawdle(void)
+{
+	volatile int i;
+
+	for (i = random() % 200; i > 0; i--);
+	if (random() % 8 == 0) {
+		thread_yield();
+	}
+}
+
+static
+void
+rwtest_read(unsigned long num)
+{
+	unsigned long val;
+
+	atomic_add(&readers_in, 1);
+	if (writers_in != 0) {
+		rwfail(num, "reader inside with a writer");
+	}
+	val = rwtestval;
+	rwtest_dawdle();
+	if (rwtestval != val) {
+		rwfail(num, "value changed under a read lock");
+	}
+	atomic_add(&readers_in, -1);
+}
+
+static
+void
+rwtest_write(unsigned long num)
+{
+	writers_in++;
+	if (writers_in != 1 || readers_in != 0) {
+		rwfail(num, "writer not alone");
+	}
+	rwtestval = num;
+	rwtest_dawdle();
+	if (rwtestval != num) {
+		rwfail(num, "value changed under a write lock");
+	}
+	writers_in--;
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS && !rwtest_failed; i++) {
+		switch (random() % 8) {
+		    case 0:
+			rwlock_acquire_write(testrw);
+			rwtest_write(num);
+			rwlock_release_write(testrw);
+			break;
+		    case 1:
+			rwlock_acquire_read(testrw);
+			rwtest_read(num);
+			if (rwlock_tryupgrade(testrw)) {
+				rwtest_write(num);
+				rwlock_release_write(testrw);
+			}
+			else {
+				rwlock_release_read(testrw);
+			}
+			break;
+		    case 2:
+			rwlock_acquire_write(testrw);
+			rwtest_write(num);
+			rwlock_downgrade(testrw);
+			rwtest_read(num);
+			rwlock_release_read(testrw);
+			break;
+		    default:
+			rwlock_acquire_read(testrw);
+			rwtest_read(num);
+			rwlock_release_read(testrw);
+			break;
+		}
+	}
+	V(rwdonesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	result = rwtest_setup();
+	if (result) {
+		return result;
+	}
+
+	kprintf("Starting rwlock test...\n");
+	for (i=0; i<NRWTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWTHREADS; i++) {
+		P(rwdonesem);
+	}
+
+	KASSERT(readers_in == 0 && writers_in == 0);
+	rwtest_cleanup();
+	kprintf("rwlock test %s.\n", rwtest_failed ? "FAILED" : "done");
+	return 0;
+}
+
+static
+void
+rwbenchthread(void *junk, unsigned long uselock)
+{
+	int i;
+	unsigned long val;
+
+	(void)junk;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		if (uselock) {
+			lock_acquire(benchlock);
+			val = rwtestval;
+			lock_release(benchlock);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			val = rwtestval;
+			rwlock_release_read(testrw);
+		}
+		(void)val;
+	}
+	V(rwdonesem);
+}
+
+static
+void
+rwbench_run(const char *what, unsigned nthreads, unsigned long uselock)
+{
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	uint64_t total;
+	unsigned i;
+	int result;
+
+	gettime(&s1, &ns1);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("rwbench", NULL, rwbenchthread,
+				     NULL, uselock);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(rwdonesem);
+	}
+	gettime(&s2, &ns2);
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	total = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("%-6s %2u threads: %8lu ns, %6lu acquires/ms\n", what,
+		nthreads, (unsigned long)total,
+		(unsigned long)((uint64_t)nthreads * NBENCHLOOPS * 1000000
+				/ (total ? total : 1)));
+}
+
+/*
+ * Usage: rwbench [maxthreads]
+ */
+int
+rwbench(int nargs, char **args)
+{
+	unsigned maxthreads, n;
+	int result;
+
+	maxthreads = 8;
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+	}
+	if (maxthreads < 1 || maxthreads > MAXBENCHTHREADS) {
+		kprintf("Usage: rwbench [maxthreads]  (1-%d)\n",
+			MAXBENCHTHREADS);
+		return EINVAL;
+	}
+
+	result = rwtest_setup();
+	if (result) {
+		return result;
+	}
+	benchlock = lock_create("rwbench");
+	if (benchlock == NULL) {
+		rwtest_cleanup();
+		return ENOMEM;
+	}
+
+	for (n=1; n<=maxthreads; n*=2) {
+		rwbench_run("rwlock", n, 0);
+		rwbench_run("lock", n, 1);
+	}
+
+	lock_destroy(benchlock);
+	rwtest_cleanup();
+	kprintf("rwbench done.\n");
+	return 0;
+}
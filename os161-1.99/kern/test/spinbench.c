@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Spinlock contention benchmark.
+ *
+ * A number of threads hammer one spinlock of each kind (test-and-set,
+ * ticket, MCS), doing a tiny critical section each time. We report how
+ * long that took and the worst "bypass" any thread saw: the number of
+ * other acquisitions that got in between two of its own.
+ *
+ * The gap runs from one acquisition to the next, and interrupts are on
+ * in between, so it includes any time the thread spent preempted or
+ * in an interrupt handler rather than spinning. Only while every
+ * thread keeps spinning (at most one thread per cpu, and no clock
+ * interrupt landing between acquisitions) does a FIFO lock with N
+ * threads keep it to N-1; otherwise ticket and MCS locks will show
+ * large gaps too. With test-and-set it can be arbitrarily large
+ * regardless.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define NSPINLOOPS		2000
+#define MAXSPINTHREADS		32
+
+static struct spinlock benchspin;
+static struct semaphore *spinstartsem;
+static struct semaphore *spindonesem;
+static volatile unsigned long spincount;
+static volatile unsigned long spinmaxgap;
+
+static
+void
+spinbenchthread(void *junk, unsigned long num)
+{
+	unsigned long last, gap, maxgap;
+	volatile int j;
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	P(spinstartsem);
+
+	last = 0;
+	maxgap = 0;
+	for (i=0; i<NSPINLOOPS; i++) {
+		spinlock_acquire(&benchspin);
+		/* Counts preempted time as well as spinning; see above. */
+		if (i > 0) {
+			gap = spincount - last - 1;
+			if (gap > maxgap) {
+				maxgap = gap;
+			}
+		}
+		last = spincount++;
+		for (j=0; j<10; j++);
+		spinlock_release(&benchspin);
+	}
+
+	spinlock_acquire(&benchspin);
+	if (maxgap > spinmaxgap) {
+		spinmaxgap = maxgap;
+	}
+	spinlock_release(&benchspin);
+
+	V(spindonesem);
+}
+
+static
+void
+spinbench_run(const char *what, unsigned kind, unsigned nthreads)
+{
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	uint64_t total;
+	unsigned i;
+	int result;
+
+	spinlock_init_kind(&benchspin, kind);
+	spincount = 0;
+	spinmaxgap = 0;
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("spinbench", NULL, spinbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("spinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	/* Let them all go at once. */
+	gettime(&s1, &ns1);
+	for (i=0; i<nthreads; i++) {
+		V(spinstartsem);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(spindonesem);
+	}
+	gettime(&s2, &ns2);
+
+	KASSERT(spincount == (unsigned long)nthreads * NSPINLOOPS);
+	spinlock_cleanup(&benchspin);
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	total = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("%-6s %2u threads: %6lu ns/acquire, max bypass %lu\n",
+		what, nthreads,
+		(unsigned long)(total / ((uint64_t)nthreads * NSPINLOOPS)),
+		spinmaxgap);
+}
+
+/*
+ * Usage: spinbench [maxthreads]
+ */
+int
+spinbench(int nargs, char **args)
+{
+	unsigned maxthreads, n;
+
+	maxthreads = 8;
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+	}
+	if (maxthreads < 1 || maxthreads > MAXSPINTHREADS) {
+		kprintf("Usage: spinbench [maxthreads]  (1-%d)\n",
+			MAXSPINTHREADS);
+		return EINVAL;
+	}
+
+	spinstartsem = sem_create("spinstart", 0);
+	if (spinstartsem == NULL) {
+		return ENOMEM;
+	}
+	spindonesem = sem_create("spindone", 0);
+	if (spindonesem == NULL) {
+		sem_destroy(spinstartsem);
+		return ENOMEM;
+	}
+
+	for (n=1; n<=maxthreads; n*=2) {
+		spinbench_run("tas", SPINLOCK_TAS, n);
+		spinbench_run("ticket", SPINLOCK_TICKET, n);
+		spinbench_run("mcs", SPINLOCK_MCS, n);
+	}
+
+	sem_destroy(spindonesem);
+	sem_destroy(spinstartsem);
+	kprintf("spinbench done.\n");
+	return 0;
+}
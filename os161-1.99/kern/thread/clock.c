@@ -29,12 +29,15 @@
 
 #include <types.h>
 #include <lib.h>
+#include <atomic.h>
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <lamebus/ltimer.h>
 #include <current.h>
+#include <mainbus.h>
+#include <workq.h>
 
 /*
  * Time handling.
@@ -55,41 +58,204 @@
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Dynamic ticks.
+ *
+ * A CPU that is idle, or that has one runnable thread and nothing
+ * else queued, has nothing for hardclock to do except count. So it
+ * sets its timer to skip the ticks in between and catches up on the
+ * count when the timer fires or when ticks are restarted, e.g.
+ * because another thread became runnable.
+ *
+ * c_tickperiod is the number of hardclock periods since the last
+ * timer interrupt that the next one will account for. c_tickless is
+ * true while periodic ticks are stopped.
  */
-static struct wchan *lbolt;
+int hardclock_dynamic = 1;
+
 /*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
+ * Timed sleeps.
+ *
+ * A thread in clocksleep() or clocknap() sleeps until an absolute
+ * deadline, counted in timerclock() ticks, and is kept in a
+ * hierarchical timing wheel keyed by that deadline. Level 0 has one
+ * slot per tick for the next TW_L0_SIZE ticks. Each slot of level N
+ * covers a whole turn of level N-1. Whenever level 0 wraps around,
+ * the next slot of level 1 is emptied back into the wheel, landing
+ * in level 0, and likewise up the levels. So each tick costs a
+ * constant amount of work plus the work of waking the threads whose
+ * deadline it is; nobody else is disturbed.
+ *
+ * Each sleeper's wheel entry lives on its own stack. The wheel is
+ * protected by the lock of the wait channel everybody sleeps on, so
+ * adding an entry and going to sleep are atomic with respect to the
+ * timer.
+ *
+ * The timer interrupt itself only counts the tick in tw_pending; the
+ * wheel is advanced, and sleepers woken, by deferred work (see
+ * workq.h), which catches up on however many ticks came in since it
+ * last ran.
  */
-static struct wchan *minibolt;
+#define TW_L0_BITS	8
+#define TW_LN_BITS	6
+#define TW_L0_SIZE	(1U << TW_L0_BITS)
+#define TW_LN_SIZE	(1U << TW_LN_BITS)
+#define TW_LEVELS	4
+/* Longest distance the wheel can hold: 2^26 ticks, ~7.7 days */
+#define TW_MAXDELTA	(1U << (TW_L0_BITS + (TW_LEVELS-1)*TW_LN_BITS))
 
-/* 
- * number of minibolts per second
+struct clocktimer {
+	struct clocktimer *ct_next;	/* next entry in same slot */
+	struct thread *ct_thread;	/* sleeping thread */
+	unsigned ct_expires;		/* tick to wake up at */
+};
+
+static struct clocktimer *tw_level0[TW_L0_SIZE];
+static struct clocktimer *tw_leveln[TW_LEVELS-1][TW_LN_SIZE];
+static unsigned tw_now;			/* next tick to process */
+static struct wchan *tw_wchan;
+static volatile unsigned tw_pending;	/* ticks not yet processed */
+static void tw_work_func(void *);
+static struct work tw_work = WORK_INITIALIZER(tw_work_func, NULL);
+
+/* timerclock ticks per second */
+#define MINI_PER_SECOND (1000000/LT_GRANULARITY)
+
+/*
+ * Setup.
  */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+void
+hardclock_bootstrap(void)
+{
+	tw_wchan = wchan_create("clocksleep");
+	if (tw_wchan == NULL) {
+		panic("Couldn't create clocksleep wchan\n");
+	}
+	/* we assume MINI_PER_SECOND > 0 */
+	KASSERT(MINI_PER_SECOND > 0);
+}
 
 /*
- * minibolt countdown
+ * Put an entry in the right slot of the wheel, relative to tw_now.
+ * An entry further away than the wheel can hold is parked in the
+ * farthest slot and put back in when it gets there.
  */
-static int minicount;
+static
+void
+tw_add(struct clocktimer *ct)
+{
+	struct clocktimer **slot;
+	unsigned delta, expires, shift, lvl;
+
+	expires = ct->ct_expires;
+	if ((int)(expires - tw_now) < 0) {
+		/* Already due; do it on the next tick. */
+		expires = tw_now;
+	}
+	delta = expires - tw_now;
+	if (delta >= TW_MAXDELTA) {
+		delta = TW_MAXDELTA - 1;
+		expires = tw_now + delta;
+	}
+
+	if (delta < TW_L0_SIZE) {
+		slot = &tw_level0[expires & (TW_L0_SIZE - 1)];
+	}
+	else {
+		shift = TW_L0_BITS;
+		for (lvl = 0; delta >= (1U << (shift + TW_LN_BITS)); lvl++) {
+			shift += TW_LN_BITS;
+		}
+		KASSERT(lvl < TW_LEVELS - 1);
+		slot = &tw_leveln[lvl][(expires >> shift) & (TW_LN_SIZE - 1)];
+	}
+	ct->ct_next = *slot;
+	*slot = ct;
+}
 
 /*
- * Setup.
+ * Sleep for at least TICKS full ticks. TICKS must be less than 2^31.
+ *
+ * The deadline counts from the newest tick that has come in, not the
+ * next one to be processed: ticks still waiting in tw_pending have
+ * already happened, and tw_work_func will replay them as soon as it
+ * gets to run. tw_pending can only grow while we hold the wchan lock,
+ * which at worst makes us sleep a tick longer.
  */
+static
 void
-hardclock_bootstrap(void)
+tw_sleep(unsigned ticks)
+{
+	struct clocktimer ct;
+
+	wchan_lock(tw_wchan);
+	ct.ct_thread = curthread;
+	ct.ct_expires = tw_now + tw_pending + ticks;
+	tw_add(&ct);
+	wchan_sleep(tw_wchan);
+}
+
+/*
+ * Process one tick: advance the wheel and wake up everybody whose
+ * time has come. The wchan lock must be held.
+ */
+static
+void
+tw_tick(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	struct clocktimer *ct, *next;
+	unsigned idx, n, lvl, now;
+
+	/* If level 0 has come around, refill it from the levels above. */
+	idx = tw_now & (TW_L0_SIZE - 1);
+	if (idx == 0) {
+		for (lvl = 0; lvl < TW_LEVELS - 1; lvl++) {
+			n = (tw_now >> (TW_L0_BITS + lvl * TW_LN_BITS))
+				& (TW_LN_SIZE - 1);
+			ct = tw_leveln[lvl][n];
+			tw_leveln[lvl][n] = NULL;
+			for (; ct != NULL; ct = next) {
+				next = ct->ct_next;
+				tw_add(ct);
+			}
+			if (n != 0) {
+				break;
+			}
+		}
 	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+
+	/* Wake up everybody whose time has come. */
+	now = tw_now++;
+	ct = tw_level0[idx];
+	tw_level0[idx] = NULL;
+	for (; ct != NULL; ct = next) {
+		next = ct->ct_next;
+		if ((int)(ct->ct_expires - now) <= 0) {
+			/* ct is on its stack; don't touch it after this */
+			wchan_wakethread(tw_wchan, ct->ct_thread);
+		}
+		else {
+			/* Parked by tw_add; not there yet */
+			tw_add(ct);
+		}
 	}
-	minicount = MINI_PER_SECOND;
-	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+}
+
+/*
+ * Deferred part of timerclock: process the ticks that have come in.
+ */
+static
+void
+tw_work_func(void *junk)
+{
+	unsigned n;
+
+	(void)junk;
+
+	wchan_lock(tw_wchan);
+	for (n = atomic_swap(&tw_pending, 0); n > 0; n--) {
+		tw_tick();
+	}
+	wchan_unlock(tw_wchan);
 }
 
 /*
@@ -99,13 +265,8 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
-	}
+	atomic_add(&tw_pending, 1);
+	work_queue(&tw_work);
 }
 
 /*
@@ -115,18 +276,96 @@ timerclock(void)
 void
 hardclock(void)
 {
+	unsigned ticks, then;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
-		schedule();
+	/*
+	 * The timer may have been set to skip some ticks. It's been
+	 * reset to the normal period by the time we get here.
+	 */
+	ticks = curcpu->c_tickperiod;
+	curcpu->c_tickperiod = 1;
+	curcpu->c_ticksavoided += ticks - 1;
+	if (curcpu->c_tickless) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		curcpu->c_tickless = false;
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+
+	then = curcpu->c_hardclocks;
+	curcpu->c_hardclocks += ticks;
+	if (then / SCHEDULE_HARDCLOCKS !=
+	    curcpu->c_hardclocks / SCHEDULE_HARDCLOCKS) {
+		schedule(then);
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
+	if (then / MIGRATE_HARDCLOCKS !=
+	    curcpu->c_hardclocks / MIGRATE_HARDCLOCKS) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	thread_tick();
+}
+
+/*
+ * Cycle clock for accounting. The cycle counter restarts at each
+ * timer interrupt, a moment before hardclock() catches up the count,
+ * so clamp to the last value returned rather than let it go back.
+ */
+uint64_t
+clock_cycles(void)
+{
+	uint64_t now;
+
+	now = (uint64_t)curcpu->c_hardclocks * (mainbus_cyclefreq() / HZ)
+		+ mainbus_cycles();
+	if (now < curcpu->c_lastclock) {
+		now = curcpu->c_lastclock;
+	}
+	curcpu->c_lastclock = now;
+	return now;
+}
+
+uint64_t
+clock_cycles_usec(uint64_t cycles)
+{
+	return cycles / (mainbus_cyclefreq() / 1000000);
+}
+
+/*
+ * Stop periodic hardclocks on the current CPU for at most MAXTICKS
+ * periods, measured from the last one.
+ */
+void
+hardclock_stop(unsigned maxticks)
+{
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (!hardclock_dynamic || maxticks <= curcpu->c_tickperiod) {
+		return;
+	}
+	curcpu->c_tickperiod = maxticks;
+	curcpu->c_tickless = true;
+	mainbus_timer_set(maxticks);
+}
+
+/*
+ * Go back to periodic hardclocks on the current CPU. The next tick
+ * comes at the next period boundary, and accounts for the ones
+ * skipped.
+ */
+void
+hardclock_resume(void)
+{
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (!curcpu->c_tickless) {
+		return;
+	}
+	curcpu->c_tickless = false;
+	curcpu->c_tickperiod = mainbus_timer_elapsed() + 1;
+	mainbus_timer_set(curcpu->c_tickperiod);
 }
 
 /*
@@ -135,11 +374,9 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	if (num_secs > 0) {
+		clockwait(num_secs, 0);
+	}
 }
 
 /*
@@ -149,9 +386,33 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	if (num_ticks > 0) {
+		tw_sleep(num_ticks);
+	}
+}
+
+/*
+ * Suspend execution for secs seconds plus nsecs nanoseconds, rounded
+ * up to a whole number of timer ticks.
+ */
+void
+clockwait(time_t secs, uint32_t nsecs)
+{
+	unsigned ticks;
+
+	KASSERT(nsecs < 1000000000);
+	if (secs < 0) {
+		return;
+	}
+	if (secs >= 0x7fffffff / MINI_PER_SECOND - 1) {
+		/* Deadlines must stay within half the tick counter's range */
+		ticks = 0x7fffffff;
+	}
+	else {
+		ticks = secs * MINI_PER_SECOND
+			+ DIVROUNDUP(nsecs, LT_GRANULARITY * 1000);
+	}
+	if (ticks > 0) {
+		tw_sleep(ticks);
+	}
 }
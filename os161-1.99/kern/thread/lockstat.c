@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock statistics. See <lockstat.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <mainbus.h>
+#include <lockstat.h>
+
+/*
+ * The table of records, open-addressed by lock address. Entries for
+ * destroyed locks are marked with lockstat_dead so that probing
+ * carries on past them; they get reused by later insertions.
+ */
+#define LOCKSTAT_NENTRIES	512
+#define LOCKSTAT_MAXTOP		32
+
+static struct lockstat lockstat_table[LOCKSTAT_NENTRIES];
+static unsigned lockstat_dropped;	/* Locks we had no room for */
+static const char lockstat_deadmark;
+#define lockstat_dead ((const void *)&lockstat_deadmark)
+
+/*
+ * The table lock. This is a bare spinlock word rather than a struct
+ * spinlock, since spinlocks themselves call in here.
+ */
+static volatile spinlock_data_t lockstat_tablelock;
+
+static
+int
+lockstat_lock(void)
+{
+	int s;
+
+	s = splhigh();
+	while (spinlock_data_testandset(&lockstat_tablelock) != 0) {
+		/* spin */
+	}
+	return s;
+}
+
+static
+void
+lockstat_unlock(int s)
+{
+	spinlock_data_set(&lockstat_tablelock, 0);
+	splx(s);
+}
+
+uint32_t
+lockstat_now(void)
+{
+	return mainbus_cycles();
+}
+
+static
+uint32_t
+lockstat_since(uint32_t start)
+{
+	uint32_t now;
+
+	now = lockstat_now();
+	/* If the counter restarted in between, count from the restart. */
+	return now >= start ? now - start : now;
+}
+
+/*
+ * Find (or make) the record for LOCK. Returns NULL if the table is
+ * full.
+ */
+static
+struct lockstat *
+lockstat_lookup(const void *lock, unsigned kind, const char *name)
+{
+	struct lockstat *ls, *free;
+	unsigned i, slot;
+	int s;
+
+	free = NULL;
+	slot = ((uintptr_t)lock >> 3) % LOCKSTAT_NENTRIES;
+
+	s = lockstat_lock();
+	for (i=0; i<LOCKSTAT_NENTRIES; i++) {
+		ls = &lockstat_table[(slot + i) % LOCKSTAT_NENTRIES];
+		if (ls->ls_lock == lock) {
+			lockstat_unlock(s);
+			return ls;
+		}
+		if (ls->ls_lock == lockstat_dead && free == NULL) {
+			free = ls;
+		}
+		if (ls->ls_lock == NULL) {
+			if (free == NULL) {
+				free = ls;
+			}
+			break;
+		}
+	}
+
+	if (free == NULL) {
+		lockstat_dropped++;
+		lockstat_unlock(s);
+		return NULL;
+	}
+
+	bzero(free, sizeof(*free));
+	free->ls_lock = lock;
+	free->ls_kind = kind;
+	if (name != NULL) {
+		snprintf(free->ls_name, LOCKSTAT_NAMELEN, "%s", name);
+	}
+	else {
+		snprintf(free->ls_name, LOCKSTAT_NAMELEN, "%p", lock);
+	}
+	lockstat_unlock(s);
+	return free;
+}
+
+void
+lockstat_acquired(struct lockstat **lsp, const void *lock, unsigned kind,
+		  const char *name, bool contended, uint32_t start)
+{
+	struct lockstat *ls;
+	uint32_t spin;
+
+	if (*lsp == NULL) {
+		*lsp = lockstat_lookup(lock, kind, name);
+		if (*lsp == NULL) {
+			return;
+		}
+	}
+	ls = *lsp;
+
+	ls->ls_acquires++;
+	if (contended) {
+		spin = lockstat_since(start);
+		ls->ls_contended++;
+		ls->ls_spincycles += spin;
+		if (spin > ls->ls_maxspin) {
+			ls->ls_maxspin = spin;
+		}
+	}
+	ls->ls_holdstart = lockstat_now();
+}
+
+void
+lockstat_released(struct lockstat *ls)
+{
+	if (ls != NULL) {
+		ls->ls_holdcycles += lockstat_since(ls->ls_holdstart);
+	}
+}
+
+void
+lockstat_slept(struct lockstat **lsp, const void *lock, unsigned kind,
+	       const char *name)
+{
+	if (*lsp == NULL) {
+		*lsp = lockstat_lookup(lock, kind, name);
+		if (*lsp == NULL) {
+			return;
+		}
+	}
+	(*lsp)->ls_sleeps++;
+}
+
+/*
+ * Drop the record for a lock that is being destroyed, so the address
+ * can be reused by a new lock without inheriting its counts.
+ */
+void
+lockstat_forget(struct lockstat **lsp)
+{
+	int s;
+
+	if (*lsp == NULL) {
+		return;
+	}
+	s = lockstat_lock();
+	(*lsp)->ls_lock = lockstat_dead;
+	lockstat_unlock(s);
+	*lsp = NULL;
+}
+
+void
+lockstat_reset(void)
+{
+	struct lockstat *ls;
+	unsigned i;
+	int s;
+
+	s = lockstat_lock();
+	for (i=0; i<LOCKSTAT_NENTRIES; i++) {
+		ls = &lockstat_table[i];
+		ls->ls_acquires = 0;
+		ls->ls_contended = 0;
+		ls->ls_sleeps = 0;
+		ls->ls_maxspin = 0;
+		ls->ls_spincycles = 0;
+		ls->ls_holdcycles = 0;
+	}
+	lockstat_dropped = 0;
+	lockstat_unlock(s);
+}
+
+/*
+ * Order for printing: most contended first, then most time waited.
+ */
+static
+bool
+lockstat_worse(const struct lockstat *a, const struct lockstat *b)
+{
+	if (a->ls_contended != b->ls_contended) {
+		return a->ls_contended > b->ls_contended;
+	}
+	return a->ls_spincycles > b->ls_spincycles;
+}
+
+void
+lockstat_print(unsigned n)
+{
+	/* Static: too big for the stack, and only the menu calls this. */
+	static struct lockstat top[LOCKSTAT_MAXTOP];
+	static const char *const kindnames[] = {
+		"spin", "sem", "lock", "cv",
+	};
+	struct lockstat *ls;
+	unsigned i, j, ntop, dropped;
+	int s;
+
+	if (n > LOCKSTAT_MAXTOP) {
+		n = LOCKSTAT_MAXTOP;
+	}
+
+	/*
+	 * Insertion-sort the worst N into TOP while holding the table
+	 * lock, then print from the copies afterwards.
+	 */
+	ntop = 0;
+	s = lockstat_lock();
+	for (i=0; i<LOCKSTAT_NENTRIES; i++) {
+		ls = &lockstat_table[i];
+		if (ls->ls_lock == NULL || ls->ls_lock == lockstat_dead ||
+		    ls->ls_acquires == 0) {
+			continue;
+		}
+		for (j = ntop; j > 0 && lockstat_worse(ls, &top[j-1]); j--) {
+			if (j < n) {
+				top[j] = top[j-1];
+			}
+		}
+		if (j < n) {
+			top[j] = *ls;
+			if (ntop < n) {
+				ntop++;
+			}
+		}
+	}
+	dropped = lockstat_dropped;
+	lockstat_unlock(s);
+
+	kprintf("%-24s %-4s %9s %9s %8s %11s %9s %11s\n", "name", "kind",
+		"acquires", "contended", "sleeps", "spin cycles", "max spin",
+		"hold cycles");
+	for (i=0; i<ntop; i++) {
+		ls = &top[i];
+		kprintf("%-24s %-4s %9u %9u %8u %11llu %9u %11llu\n",
+			ls->ls_name, kindnames[ls->ls_kind],
+			ls->ls_acquires, ls->ls_contended, ls->ls_sleeps,
+			(unsigned long long)ls->ls_spincycles,
+			ls->ls_maxspin,
+			(unsigned long long)ls->ls_holdcycles);
+	}
+	if (dropped > 0) {
+		kprintf("(%u locks not tracked: table full)\n", dropped);
+	}
+}
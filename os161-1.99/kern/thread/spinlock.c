@@ -35,6 +35,7 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <atomic.h>
 #include <current.h>	/* for curcpu */
 
 /*
@@ -46,10 +47,25 @@
  * Initialize spinlock.
  */
 void
-spinlock_init(struct spinlock *lk)
+spinlock_init_kind(struct spinlock *lk, unsigned kind)
 {
+	KASSERT(kind == SPINLOCK_TAS || kind == SPINLOCK_TICKET ||
+		kind == SPINLOCK_MCS);
+
 	spinlock_data_set(&lk->lk_lock, 0);
+	lk->lk_next = 0;
+	lk->lk_serving = 0;
+	lk->lk_tail = NULL;
+	lk->lk_node = NULL;
 	lk->lk_holder = NULL;
+	lk->lk_kind = kind;
+	LOCKSTAT_INIT(lk->lk_stat);
+}
+
+void
+spinlock_init(struct spinlock *lk)
+{
+	spinlock_init_kind(lk, SPINLOCK_TICKET);
 }
 
 /*
@@ -60,6 +76,38 @@ spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
 	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(lk->lk_next == lk->lk_serving);
+	KASSERT(lk->lk_tail == NULL);
+	LOCKSTAT_FORGET(lk->lk_stat);
+}
+
+/*
+ * MCS queue nodes.
+ *
+ * Interrupts are off whenever we hold or wait for a spinlock, so the
+ * current cpu's pool can be used without further locking. Before
+ * curcpu is set up there is only one cpu running, and it uses a small
+ * static pool instead.
+ */
+static struct mcsnode spinlock_bootnodes[SPINLOCK_MCSNODES];
+
+static
+struct mcsnode *
+spinlock_mcsnode_get(void)
+{
+	struct mcsnode *pool;
+	unsigned i;
+
+	pool = CURCPU_EXISTS() ? curcpu->c_mcsnodes : spinlock_bootnodes;
+	for (i=0; i<SPINLOCK_MCSNODES; i++) {
+		if (!pool[i].mn_inuse) {
+			pool[i].mn_inuse = true;
+			pool[i].mn_next = NULL;
+			pool[i].mn_locked = true;
+			return &pool[i];
+		}
+	}
+	panic("spinlock: out of MCS nodes\n");
 }
 
 /*
@@ -73,6 +121,10 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	struct mcsnode *node, *pred;
+	unsigned ticket;
+	uint32_t start;
+	bool contended;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +139,70 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
+	start = LOCKSTAT_NOW();
+	contended = false;
+
+	switch (lk->lk_kind) {
+	    case SPINLOCK_TICKET:
 		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
+		 * Take the next ticket and wait for it to come up.
+		 * Everyone ahead of us gets the lock exactly once
+		 * before we do, so the wait is bounded.
 		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
+		ticket = atomic_add(&lk->lk_next, 1) - 1;
+		while (lk->lk_serving != ticket) {
+			contended = true;
 		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
+		break;
+
+	    case SPINLOCK_MCS:
+		/*
+		 * Put our node at the tail of the queue. If there was
+		 * somebody ahead of us, link in behind them and spin
+		 * on our own node until they hand the lock over.
+		 */
+		node = spinlock_mcsnode_get();
+		pred = (struct mcsnode *)atomic_swap(
+			(volatile unsigned *)&lk->lk_tail, (unsigned)node);
+		if (pred != NULL) {
+			contended = true;
+			pred->mn_next = node;
+			while (node->mn_locked) {
+				/* spin */
+			}
+		}
+		lk->lk_node = node;
+		break;
+
+	    default:
+		while (1) {
+			/*
+			 * Do test-test-and-set, that is, read first
+			 * before doing test-and-set, to reduce bus
+			 * contention.
+			 *
+			 * Test-and-set is a machine-level atomic
+			 * operation that writes 1 into the lock word
+			 * and returns the previous value. If that
+			 * value was 0, the lock was previously unheld
+			 * and we now own it. If it was 1, we don't.
+			 */
+			if (spinlock_data_get(&lk->lk_lock) != 0) {
+				contended = true;
+				continue;
+			}
+			if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+				contended = true;
+				continue;
+			}
+			break;
 		}
 		break;
 	}
 
 	lk->lk_holder = mycpu;
+	LOCKSTAT_ACQUIRED(lk->lk_stat, lk, LOCKSTAT_SPINLOCK, NULL,
+			  contended, start);
 }
 
 /*
@@ -116,13 +211,46 @@ spinlock_acquire(struct spinlock *lk)
 void
 spinlock_release(struct spinlock *lk)
 {
+	struct mcsnode *node;
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+	LOCKSTAT_RELEASED(lk->lk_stat);
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+
+	switch (lk->lk_kind) {
+	    case SPINLOCK_TICKET:
+		/* Only the holder writes lk_serving. */
+		lk->lk_serving = lk->lk_serving + 1;
+		break;
+
+	    case SPINLOCK_MCS:
+		node = lk->lk_node;
+		lk->lk_node = NULL;
+		if (node->mn_next == NULL) {
+			/* Nobody visible behind us; try to empty the queue. */
+			if (atomic_cas((volatile unsigned *)&lk->lk_tail,
+				       (unsigned)node, 0) == (unsigned)node) {
+				node->mn_inuse = false;
+				break;
+			}
+			/* Someone is linking in; wait for them. */
+			while (node->mn_next == NULL) {
+				/* spin */
+			}
+		}
+		node->mn_next->mn_locked = false;
+		node->mn_inuse = false;
+		break;
+
+	    default:
+		spinlock_data_set(&lk->lk_lock, 0);
+		break;
+	}
+
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
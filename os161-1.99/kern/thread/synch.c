@@ -35,61 +35,162 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <atomic.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem_cache.h>
+
+////////////////////////////////////////////////////////////
+//
+// Object caches.
+//
+// Semaphores, locks, and CVs come from object caches. The constructors
+// set up the parts that *_destroy checks are back in their initial
+// state, so only the rest needs setting up on each *_create.
+
+static struct kmem_cache *sem_objcache;
+static struct kmem_cache *lock_objcache;
+static struct kmem_cache *cv_objcache;
+
+static
+void
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_init(&sem->sem_lock);
+	sem->sem_nwaiters = 0;
+	sem->sem_handoff = 0;
+}
+
+static
+void
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_init(&lock->lk_spinlock);
+	lock->lk_owner = 0;
+	lock->lk_nwaiters = 0;
+	bzero(lock->lk_pilevels, sizeof(lock->lk_pilevels));
+	lock->lk_piowner = NULL;
+	lock->lk_pinext = NULL;
+}
+
+static
+void
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_nwaiters = 0;
+}
+
+void
+synch_bootstrap(void)
+{
+	sem_objcache = kmem_cache_create("semaphore",
+					 sizeof(struct semaphore), 0,
+					 sem_ctor);
+	lock_objcache = kmem_cache_create("lock", sizeof(struct lock), 0,
+					  lock_ctor);
+	cv_objcache = kmem_cache_create("cv", sizeof(struct cv), 0,
+					cv_ctor);
+	if (sem_objcache == NULL || lock_objcache == NULL ||
+	    cv_objcache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+static
 struct semaphore *
-sem_create(const char *name, int initial_count)
+sem_create_common(const char *name, int initial_count, bool fifo)
 {
         struct semaphore *sem;
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = kmem_cache_alloc(sem_objcache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                kmem_cache_free(sem_objcache, sem);
                 return NULL;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		kmem_cache_free(sem_objcache, sem);
 		return NULL;
 	}
 
-	spinlock_init(&sem->sem_lock);
         sem->sem_count = initial_count;
+	sem->sem_fifo = fifo;
+	LOCKSTAT_INIT(sem->sem_stat);
 
         return sem;
 }
 
+struct semaphore *
+sem_create(const char *name, int initial_count)
+{
+	return sem_create_common(name, initial_count, false);
+}
+
+struct semaphore *
+sem_create_handoff(const char *name, int initial_count)
+{
+	return sem_create_common(name, initial_count, true);
+}
+
 void
 sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
+	KASSERT(sem->sem_nwaiters == 0);
+	KASSERT(sem->sem_handoff == 0);
 
 	/* wchan_cleanup will assert if anyone's waiting on it */
+	LOCKSTAT_FORGET(sem->sem_stat);
 	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(sem_objcache, sem);
+}
+
+/*
+ * Take one from the count if it's positive. Returns true on success.
+ */
+static
+bool
+sem_trydec(struct semaphore *sem)
+{
+	unsigned count;
+
+	while ((count = sem->sem_count) > 0) {
+		if (atomic_cas(&sem->sem_count, count, count - 1) == count) {
+			return true;
+		}
+	}
+	return false;
 }
 
 void 
 P(struct semaphore *sem)
 {
+	uint32_t start;
+	bool slept;
+
         KASSERT(sem != NULL);
 
         /*
@@ -100,46 +201,120 @@ P(struct semaphore *sem)
          */
         KASSERT(curthread->t_in_interrupt == false);
 
+	start = LOCKSTAT_NOW();
+
+	/*
+	 * Fast path: the count is positive. A handoff semaphore never
+	 * puts a unit in the count while there are sleepers it hasn't
+	 * served, but don't even try if there are; we'd be cutting in
+	 * line.
+	 */
+	if (!(sem->sem_fifo && sem->sem_nwaiters > sem->sem_handoff) &&
+	    sem_trydec(sem)) {
+		LOCKSTAT_ACQUIRED(sem->sem_stat, sem, LOCKSTAT_SEM,
+				  sem->sem_name, false, start);
+		return;
+	}
+
+	/*
+	 * Register as a waiter before looking at the count again. V
+	 * bumps the count before looking at sem_nwaiters (or, for a
+	 * handoff semaphore, decides under sem_lock), so either we see
+	 * its unit here or it sees us and does a wakeup.
+	 *
+	 * On a handoff semaphore we only take from the count if nobody
+	 * else is waiting for a unit, so we queue up behind them.
+	 */
+	slept = false;
 	spinlock_acquire(&sem->sem_lock);
-        while (sem->sem_count == 0) {
+	sem->sem_nwaiters++;
+	while (1) {
+		if (slept && sem->sem_handoff > 0) {
+			/* V gave us a unit directly. */
+			KASSERT(sem->sem_fifo);
+			sem->sem_handoff--;
+			break;
+		}
+		if ((!sem->sem_fifo ||
+		     sem->sem_nwaiters - 1 <= sem->sem_handoff) &&
+		    sem_trydec(sem)) {
+			break;
+		}
+
 		/*
 		 * Bridge to the wchan lock, so if someone else comes
 		 * along in V right this instant the wakeup can't go
 		 * through on the wchan until we've finished going to
 		 * sleep. Note that wchan_sleep unlocks the wchan.
 		 *
-		 * Note that we don't maintain strict FIFO ordering of
-		 * threads going through the semaphore; that is, we
-		 * might "get" it on the first try even if other
-		 * threads are waiting. Apparently according to some
-		 * textbooks semaphores must for some reason have
-		 * strict ordering. Too bad. :-)
-		 *
-		 * Exercise: how would you implement strict FIFO
-		 * ordering?
+		 * Unless the semaphore was made with
+		 * sem_create_handoff, we don't maintain strict FIFO
+		 * ordering of threads going through the semaphore;
+		 * that is, we might "get" it on the first try even if
+		 * other threads are waiting.
 		 */
+		LOCKSTAT_SLEPT(sem->sem_stat, sem, LOCKSTAT_SEM,
+			       sem->sem_name);
 		wchan_lock(sem->sem_wchan);
 		spinlock_release(&sem->sem_lock);
                 wchan_sleep(sem->sem_wchan);
 
 		spinlock_acquire(&sem->sem_lock);
+		slept = true;
         }
-        KASSERT(sem->sem_count > 0);
-        sem->sem_count--;
+	KASSERT(sem->sem_nwaiters > 0);
+	sem->sem_nwaiters--;
+	LOCKSTAT_ACQUIRED(sem->sem_stat, sem, LOCKSTAT_SEM, sem->sem_name,
+			  true, start);
 	spinlock_release(&sem->sem_lock);
 }
 
 void
 V(struct semaphore *sem)
 {
+	unsigned count;
+
         KASSERT(sem != NULL);
 
-	spinlock_acquire(&sem->sem_lock);
+	if (sem->sem_fifo) {
+		/*
+		 * Give the unit straight to a sleeper that hasn't been
+		 * served, if there is one; only put it in the count if
+		 * not. Everybody in sem_nwaiters is on the wchan, on
+		 * the way there, or has already been handed a unit.
+		 * Doing this under sem_lock is what keeps P's fast
+		 * path from taking the unit ahead of the sleepers.
+		 */
+		spinlock_acquire(&sem->sem_lock);
+		if (sem->sem_nwaiters > sem->sem_handoff) {
+			sem->sem_handoff++;
+			wchan_wakeone(sem->sem_wchan);
+		}
+		else {
+			count = atomic_add(&sem->sem_count, 1);
+			KASSERT(count > 0);
+		}
+		spinlock_release(&sem->sem_lock);
+		return;
+	}
+
+	count = atomic_add(&sem->sem_count, 1);
+	KASSERT(count > 0);
 
-        sem->sem_count++;
-        KASSERT(sem->sem_count > 0);
-	wchan_wakeone(sem->sem_wchan);
+	/* Fast path: nobody is waiting. */
+	if (sem->sem_nwaiters == 0) {
+		return;
+	}
 
+	/*
+	 * Wake someone up to compete for the count. If the unit has
+	 * gone already this may be a wasted wakeup, but the sleeper
+	 * just checks and goes back to sleep.
+	 */
+	spinlock_acquire(&sem->sem_lock);
+	if (sem->sem_nwaiters > 0) {
+		wchan_wakeone(sem->sem_wchan);
+	}
 	spinlock_release(&sem->sem_lock);
 }
 
@@ -147,24 +322,230 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * How many times to poll the lock word while the owner is running
+ * before giving up and going to sleep. Critical sections protected by
+ * sleeping locks are usually short, so a brief spin is much cheaper
+ * than two context switches; if the owner is still running after this
+ * it's probably doing something slow and we should get off the CPU.
+ */
+#define LOCK_SPIN_MAX	1000
+
+/*
+ * Priority inheritance. pi_spinlock protects t_inherited, t_blockedon,
+ * t_pilevel and t_pilocks in every thread, and the lk_pi* fields in
+ * every lock; one global lock keeps chain walks simple, and it's only
+ * taken on the sleeping paths. It nests inside lk_spinlock and outside
+ * the run queue locks.
+ *
+ * Inherited levels are passed along at most PI_MAXDEPTH locks deep, so
+ * a long (or, with a deadlock, circular) chain can't keep us here.
+ */
+#define PI_MAXDEPTH	4
+
+bool lock_priority_inheritance = true;
+static struct spinlock pi_spinlock = SPINLOCK_INITIALIZER;
+
+/*
+ * Best level counted on a lock, or SCHED_NLEVELS if none.
+ */
+static
+unsigned
+lock_pi_best(struct lock *lock)
+{
+	unsigned i;
+
+	for (i = 0; i < SCHED_NLEVELS; i++) {
+		if (lock->lk_pilevels[i] > 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Take a lock off its lk_piowner's t_pilocks.
+ */
+static
+void
+lock_pi_unlink(struct lock *lock)
+{
+	struct lock **lp;
+
+	KASSERT(spinlock_do_i_hold(&pi_spinlock));
+	KASSERT(lock->lk_piowner != NULL);
+
+	for (lp = &lock->lk_piowner->t_pilocks; *lp != lock;
+	     lp = &(*lp)->lk_pinext) {
+		KASSERT(*lp != NULL);
+	}
+	*lp = lock->lk_pinext;
+	lock->lk_pinext = NULL;
+	lock->lk_piowner = NULL;
+}
+
+/*
+ * Put a lock on OWNER's t_pilocks, moving it off anyone else's.
+ */
+static
+void
+lock_pi_link(struct lock *lock, struct thread *owner)
+{
+	KASSERT(spinlock_do_i_hold(&pi_spinlock));
+
+	if (lock->lk_piowner == owner) {
+		return;
+	}
+	if (lock->lk_piowner != NULL) {
+		lock_pi_unlink(lock);
+	}
+	lock->lk_pinext = owner->t_pilocks;
+	owner->t_pilocks = lock;
+	lock->lk_piowner = owner;
+}
+
+/*
+ * Recompute what T inherits from the locks it holds, and if that
+ * changes the level T itself is counted at in a lock it's waiting
+ * for, pass the change on to that lock's owner, and so on.
+ *
+ * The owner is read from lk_owner without lk_spinlock. If it's stale
+ * (the owner is just now releasing) that thread will unlink the lock
+ * and recompute under pi_spinlock after clearing lk_owner, which
+ * undoes whatever we do to it here.
+ */
+static
+void
+lock_pi_adjust(struct thread *t)
+{
+	struct lock *lock;
+	unsigned level, best, depth;
+
+	KASSERT(spinlock_do_i_hold(&pi_spinlock));
+
+	for (depth = 0; depth < PI_MAXDEPTH; depth++) {
+		best = SCHED_NLEVELS;
+		for (lock = t->t_pilocks; lock != NULL; lock = lock->lk_pinext) {
+			level = lock_pi_best(lock);
+			if (level < best) {
+				best = level;
+			}
+		}
+		if (best != t->t_inherited) {
+			thread_setinherited(t, best);
+		}
+
+		lock = t->t_blockedon;
+		if (lock == NULL) {
+			break;
+		}
+		level = thread_effpriority(t);
+		if (level == t->t_pilevel) {
+			break;
+		}
+		KASSERT(lock->lk_pilevels[t->t_pilevel] > 0);
+		lock->lk_pilevels[t->t_pilevel]--;
+		lock->lk_pilevels[level]++;
+		t->t_pilevel = level;
+
+		t = (struct thread *)(lock->lk_owner & ~LK_WAITERS);
+		if (t == NULL) {
+			break;
+		}
+		lock_pi_link(lock, t);
+	}
+}
+
+/*
+ * About to sleep on LOCK: count ourselves against it and boost its
+ * owner. Called with lk_spinlock held and LK_WAITERS set, so the owner
+ * can't let go of the lock under us.
+ */
+static
+void
+lock_pi_block(struct lock *lock)
+{
+	struct thread *owner;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_spinlock));
+
+	spinlock_acquire(&pi_spinlock);
+	KASSERT(curthread->t_blockedon == NULL);
+	curthread->t_blockedon = lock;
+	curthread->t_pilevel = thread_effpriority(curthread);
+	lock->lk_pilevels[curthread->t_pilevel]++;
+
+	owner = (struct thread *)(lock->lk_owner & ~LK_WAITERS);
+	KASSERT(owner != NULL);
+	lock_pi_link(lock, owner);
+	lock_pi_adjust(owner);
+	spinlock_release(&pi_spinlock);
+}
+
+/*
+ * cv_morph moved T, asleep on a CV, onto LOCK's wchan: count it
+ * against the lock as if it had blocked there itself. lock_wait
+ * undoes this when T wakes up. Called with lk_spinlock held.
+ */
+static
+void
+lock_pi_transfer(struct thread *t, void *data)
+{
+	struct lock *lock = data;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_spinlock));
+
+	spinlock_acquire(&pi_spinlock);
+	KASSERT(t->t_blockedon == NULL);
+	t->t_blockedon = lock;
+	t->t_pilevel = thread_effpriority(t);
+	lock->lk_pilevels[t->t_pilevel]++;
+	spinlock_release(&pi_spinlock);
+}
+
+/*
+ * Woke up: stop counting against the lock we were waiting for. Its
+ * owner has already recomputed (or will, when it releases), so there
+ * is nothing to undo there.
+ */
+static
+void
+lock_pi_unblock(struct lock *lock)
+{
+	spinlock_acquire(&pi_spinlock);
+	KASSERT(curthread->t_blockedon == lock);
+	KASSERT(lock->lk_pilevels[curthread->t_pilevel] > 0);
+	lock->lk_pilevels[curthread->t_pilevel]--;
+	curthread->t_blockedon = NULL;
+	curthread->t_pilevel = SCHED_NLEVELS;
+	spinlock_release(&pi_spinlock);
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(lock_objcache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(lock_objcache, lock);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        
+
+	lock->lk_wchan = wchan_create(lock->lk_name);
+	if (lock->lk_wchan == NULL) {
+		kfree(lock->lk_name);
+		kmem_cache_free(lock_objcache, lock);
+		return NULL;
+	}
+
+	LOCKSTAT_INIT(lock->lk_stat);
+
         return lock;
 }
 
@@ -172,37 +553,229 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
+	KASSERT(lock->lk_owner == 0);
+	KASSERT(lock->lk_nwaiters == 0);
+	KASSERT(lock_pi_best(lock) == SCHED_NLEVELS);
+	KASSERT(lock->lk_piowner == NULL);
 
-        // add stuff here as needed
-        
+	/* wchan_cleanup will assert if anyone's waiting on it */
+	LOCKSTAT_FORGET(lock->lk_stat);
+	spinlock_cleanup(&lock->lk_spinlock);
+	wchan_destroy(lock->lk_wchan);
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(lock_objcache, lock);
+}
+
+/*
+ * Spin while the lock is held by a thread that is running on another
+ * CPU. Returns true if we got the lock along the way.
+ *
+ * The owner's t_state is read without any lock; it is only a hint.
+ * A thread that's in S_RUN and isn't us is on some other CPU right
+ * now, so it may well release the lock soon. Once it blocks or gets
+ * preempted, or the spin budget runs out, we stop and let the caller
+ * sleep instead.
+ */
+static
+bool
+lock_spin(struct lock *lock, unsigned me)
+{
+	struct thread *owner;
+	unsigned word;
+	unsigned i;
+
+	for (i = 0; i < LOCK_SPIN_MAX; i++) {
+		word = lock->lk_owner;
+		if (word == 0) {
+			if (atomic_cas(&lock->lk_owner, 0, me) == 0) {
+				return true;
+			}
+			continue;
+		}
+		owner = (struct thread *)(word & ~LK_WAITERS);
+		if (owner->t_state != S_RUN) {
+			break;
+		}
+	}
+	return false;
+}
+
+/*
+ * Slow path of lock_acquire: sleep on the lock's wchan until we can
+ * get it.
+ *
+ * QUEUED is true if the caller has already been put on the wchan and
+ * counted in lk_nwaiters on its behalf, and has just been woken up;
+ * that's how cv_wait comes back after cv_signal moved it over.
+ */
+static
+void
+lock_wait(struct lock *lock, unsigned me, bool queued, uint32_t start)
+{
+	unsigned word;
+	bool pi;
+
+	spinlock_acquire(&lock->lk_spinlock);
+	if (queued) {
+		KASSERT(lock->lk_nwaiters > 0);
+		lock->lk_nwaiters--;
+		/*
+		 * cv_morph counted us against the lock if inheritance
+		 * was on then. Nobody else touches t_blockedon while
+		 * we're awake, so it's safe to look without the lock.
+		 */
+		if (curthread->t_blockedon == lock) {
+			lock_pi_unblock(lock);
+		}
+	}
+	while (1) {
+		word = lock->lk_owner;
+		if (word == 0) {
+			/*
+			 * Free. Keep the waiters bit set if anyone
+			 * else is still asleep, so our release goes
+			 * through the slow path and wakes them.
+			 */
+			if (atomic_cas(&lock->lk_owner, 0, me |
+			    (lock->lk_nwaiters > 0 ? LK_WAITERS : 0)) == 0) {
+				break;
+			}
+			continue;
+		}
+		if ((word & LK_WAITERS) == 0) {
+			/*
+			 * Mark that there are waiters. This races with
+			 * the owner's fast-path release; if the owner
+			 * wins, the word changed and we go around again.
+			 */
+			if (atomic_cas(&lock->lk_owner, word,
+				       word | LK_WAITERS) != word) {
+				continue;
+			}
+		}
+
+		/*
+		 * Bridge to the wchan lock as in P(): the releaser has
+		 * to get lk_spinlock, then the wchan lock, to wake us,
+		 * so it can't slip in before we're on the wchan.
+		 */
+		lock->lk_nwaiters++;
+		pi = lock_priority_inheritance;
+		if (pi) {
+			lock_pi_block(lock);
+		}
+		LOCKSTAT_SLEPT(lock->lk_stat, lock, LOCKSTAT_LOCK,
+			       lock->lk_name);
+		wchan_lock(lock->lk_wchan);
+		spinlock_release(&lock->lk_spinlock);
+		wchan_sleep(lock->lk_wchan);
+
+		spinlock_acquire(&lock->lk_spinlock);
+		KASSERT(lock->lk_nwaiters > 0);
+		lock->lk_nwaiters--;
+		if (pi) {
+			lock_pi_unblock(lock);
+		}
+	}
+
+	/*
+	 * If others are still counted against the lock, inherit their
+	 * level now rather than waiting for one of them to wake up and
+	 * block again. Anyone counted is also in lk_nwaiters, so we
+	 * kept LK_WAITERS and will unlink the lock in lock_release.
+	 */
+	if (lock->lk_nwaiters > 0) {
+		spinlock_acquire(&pi_spinlock);
+		if (lock_pi_best(lock) < SCHED_NLEVELS) {
+			lock_pi_link(lock, curthread);
+			lock_pi_adjust(curthread);
+		}
+		spinlock_release(&pi_spinlock);
+	}
+	spinlock_release(&lock->lk_spinlock);
+
+	KASSERT(lock_do_i_hold(lock));
+	LOCKSTAT_ACQUIRED(lock->lk_stat, lock, LOCKSTAT_LOCK, lock->lk_name,
+			  true, start);
 }
 
 void
 lock_acquire(struct lock *lock)
 {
-        // Write this
+	unsigned me;
+	uint32_t start;
+
+	KASSERT(lock != NULL);
+
+	/*
+	 * May not block in an interrupt handler.
+	 *
+	 * As with P(), always check, even if we can actually get the
+	 * lock without blocking.
+	 */
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(!lock_do_i_hold(lock));
+
+	me = (unsigned)curthread;
+	KASSERT((me & LK_WAITERS) == 0);
+
+	start = LOCKSTAT_NOW();
 
-        (void)lock;  // suppress warning until code gets written
+	/* Fast path: the lock is free. */
+	if (atomic_cas(&lock->lk_owner, 0, me) == 0) {
+		LOCKSTAT_ACQUIRED(lock->lk_stat, lock, LOCKSTAT_LOCK,
+				  lock->lk_name, false, start);
+		return;
+	}
+
+	if (lock_spin(lock, me)) {
+		LOCKSTAT_ACQUIRED(lock->lk_stat, lock, LOCKSTAT_LOCK,
+				  lock->lk_name, true, start);
+		return;
+	}
+
+	lock_wait(lock, me, false, start);
 }
 
 void
 lock_release(struct lock *lock)
 {
-        // Write this
+	unsigned me;
+
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	LOCKSTAT_RELEASED(lock->lk_stat);
+
+	/* Fast path: nobody is waiting. */
+	me = (unsigned)curthread;
+	if (atomic_cas(&lock->lk_owner, me, 0) == me) {
+		return;
+	}
+
+	spinlock_acquire(&lock->lk_spinlock);
+	KASSERT(lock->lk_owner == (me | LK_WAITERS));
+	lock->lk_owner = 0;
+	if (lock->lk_nwaiters > 0) {
+		wchan_wakeone(lock->lk_wchan);
+	}
+	spinlock_release(&lock->lk_spinlock);
 
-        (void)lock;  // suppress warning until code gets written
+	/* Give back whatever we inherited through this lock. */
+	spinlock_acquire(&pi_spinlock);
+	if (lock->lk_piowner == curthread) {
+		lock_pi_unlink(lock);
+	}
+	lock_pi_adjust(curthread);
+	spinlock_release(&pi_spinlock);
 }
 
 bool
 lock_do_i_hold(struct lock *lock)
 {
-        // Write this
-
-        (void)lock;  // suppress warning until code gets written
+	KASSERT(lock != NULL);
 
-        return true; // dummy until code gets written
+	return (lock->lk_owner & ~LK_WAITERS) == (unsigned)curthread;
 }
 
 ////////////////////////////////////////////////////////////
@@ -215,18 +788,25 @@ cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = kmem_cache_alloc(cv_objcache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                kmem_cache_free(cv_objcache, cv);
                 return NULL;
         }
-        
-        // add stuff here as needed
+
+	cv->cv_wchan = wchan_create(cv->cv_name);
+	if (cv->cv_wchan == NULL) {
+		kfree(cv->cv_name);
+		kmem_cache_free(cv_objcache, cv);
+		return NULL;
+	}
+
+	LOCKSTAT_INIT(cv->cv_stat);
         
         return cv;
 }
@@ -235,33 +815,407 @@ void
 cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
+	KASSERT(cv->cv_nwaiters == 0);
 
-        // add stuff here as needed
-        
+	/* wchan_cleanup will assert if anyone's waiting on it */
+	LOCKSTAT_FORGET(cv->cv_stat);
+	wchan_destroy(cv->cv_wchan);
         kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(cv_objcache, cv);
 }
 
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-        // Write this
-        (void)cv;    // suppress warning until code gets written
-        (void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(lock_do_i_hold(lock));
+
+	/* Counted under LOCK, which we hold. */
+	cv->cv_nwaiters++;
+	LOCKSTAT_SLEPT(cv->cv_stat, cv, LOCKSTAT_CV, cv->cv_name);
+
+	/*
+	 * Lock the wchan before letting go of LOCK, so that a signal
+	 * (which needs LOCK, then the wchan) can't get in before we're
+	 * asleep.
+	 */
+	wchan_lock(cv->cv_wchan);
+	lock_release(lock);
+	wchan_sleep(cv->cv_wchan);
+
+	/*
+	 * cv_signal or cv_broadcast moved us onto LOCK's wchan, and
+	 * lock_release then woke us from there. We are already
+	 * counted as a waiter for the lock.
+	 */
+	lock_wait(lock, (unsigned)curthread, true, LOCKSTAT_NOW());
+}
+
+/*
+ * Wait morphing: move up to MAX waiters from the CV straight onto
+ * the lock's wchan, rather than waking them only for them to go back
+ * to sleep on the lock, which the caller holds. They get woken one
+ * at a time as the lock is released. With priority inheritance on,
+ * they're counted against the lock like any other waiter, so the
+ * caller (and whoever holds the lock after it) runs at the level of
+ * the best of them.
+ */
+static
+void
+cv_morph(struct cv *cv, struct lock *lock, unsigned max)
+{
+	unsigned n;
+	bool pi;
+
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	/* Nobody waiting: no need to touch the wchan. */
+	if (cv->cv_nwaiters == 0) {
+		return;
+	}
+
+	wchan_lock(cv->cv_wchan);
+	spinlock_acquire(&lock->lk_spinlock);
+	pi = lock_priority_inheritance;
+	n = wchan_transfer(cv->cv_wchan, lock->lk_wchan, max,
+			   pi ? lock_pi_transfer : NULL, lock);
+	if (n > 0) {
+		KASSERT(cv->cv_nwaiters >= n);
+		cv->cv_nwaiters -= n;
+		lock->lk_nwaiters += n;
+		/*
+		 * Make our release take the slow path and wake them.
+		 * We hold the lock and lk_spinlock, so nobody else
+		 * can be changing the word.
+		 */
+		lock->lk_owner |= LK_WAITERS;
+
+		if (pi) {
+			spinlock_acquire(&pi_spinlock);
+			lock_pi_link(lock, curthread);
+			lock_pi_adjust(curthread);
+			spinlock_release(&pi_spinlock);
+		}
+	}
+	spinlock_release(&lock->lk_spinlock);
+	wchan_unlock(cv->cv_wchan);
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-        // Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	cv_morph(cv, lock, 1);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	// Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	cv_morph(cv, lock, (unsigned)-1);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_rwchan = wchan_create(rw->rw_name);
+	if (rw->rw_rwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_wwchan = wchan_create(rw->rw_name);
+	if (rw->rw_wwchan == NULL) {
+		wchan_destroy(rw->rw_rwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_spinlock);
+	rw->rw_word = 0;
+	rw->rw_writer = NULL;
+	rw->rw_nrwait = 0;
+	rw->rw_nwwait = 0;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_word == 0);
+	KASSERT(rw->rw_nrwait == 0 && rw->rw_nwwait == 0);
+
+	spinlock_cleanup(&rw->rw_spinlock);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+/*
+ * Hand the lock on after the last holder has left. Must be called
+ * with rw_spinlock held, once there is no writer and no readers.
+ *
+ * A waiting writer goes first; RW_WWAIT stays set so new readers keep
+ * out of its way. Otherwise everyone waiting to read is let in at
+ * once.
+ */
+static
+void
+rwlock_wake(struct rwlock *rw)
+{
+	unsigned word;
+
+	KASSERT(spinlock_do_i_hold(&rw->rw_spinlock));
+
+	if (rw->rw_nwwait > 0) {
+		KASSERT(rw->rw_word & RW_WWAIT);
+		wchan_wakeone(rw->rw_wwchan);
+		return;
+	}
+
+	if (rw->rw_nrwait > 0) {
+		/* Readers may be arriving on the fast path meanwhile. */
+		do {
+			word = rw->rw_word;
+		} while (atomic_cas(&rw->rw_word, word,
+				    word & ~RW_RWAIT) != word);
+		wchan_wakeall(rw->rw_rwchan);
+	}
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	unsigned word;
+
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(!rwlock_do_i_hold_write(rw));
+
+	/* Fast path: no writer holding or waiting. */
+	word = rw->rw_word;
+	if ((word & (RW_WRITER | RW_WWAIT)) == 0 &&
+	    atomic_cas(&rw->rw_word, word, word + 1) == word) {
+		return;
+	}
+
+	spinlock_acquire(&rw->rw_spinlock);
+	while (1) {
+		word = rw->rw_word;
+		if ((word & (RW_WRITER | RW_WWAIT)) == 0) {
+			KASSERT((word & RW_READMASK) < RW_READMASK);
+			if (atomic_cas(&rw->rw_word, word, word + 1) == word) {
+				break;
+			}
+			continue;
+		}
+		if ((word & RW_RWAIT) == 0) {
+			if (atomic_cas(&rw->rw_word, word,
+				       word | RW_RWAIT) != word) {
+				continue;
+			}
+		}
+
+		/* Bridge to the wchan lock, as in lock_acquire. */
+		rw->rw_nrwait++;
+		wchan_lock(rw->rw_rwchan);
+		spinlock_release(&rw->rw_spinlock);
+		wchan_sleep(rw->rw_rwchan);
+
+		spinlock_acquire(&rw->rw_spinlock);
+		KASSERT(rw->rw_nrwait > 0);
+		rw->rw_nrwait--;
+	}
+	spinlock_release(&rw->rw_spinlock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	unsigned word;
+
+	KASSERT(rw != NULL);
+
+	/*
+	 * Fast path: unless we're the last reader out and somebody is
+	 * waiting, just drop the count.
+	 */
+	while (1) {
+		word = rw->rw_word;
+		KASSERT((word & RW_WRITER) == 0);
+		KASSERT((word & RW_READMASK) > 0);
+		if ((word & RW_READMASK) == 1 &&
+		    (word & (RW_WWAIT | RW_RWAIT)) != 0) {
+			break;
+		}
+		if (atomic_cas(&rw->rw_word, word, word - 1) == word) {
+			return;
+		}
+	}
+
+	spinlock_acquire(&rw->rw_spinlock);
+	do {
+		word = rw->rw_word;
+	} while (atomic_cas(&rw->rw_word, word, word - 1) != word);
+	if (((word - 1) & RW_READMASK) == 0) {
+		rwlock_wake(rw);
+	}
+	spinlock_release(&rw->rw_spinlock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	unsigned word, newword;
+
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(!rwlock_do_i_hold_write(rw));
+
+	/* Fast path: the lock is idle. */
+	if (atomic_cas(&rw->rw_word, 0, RW_WRITER) == 0) {
+		rw->rw_writer = curthread;
+		return;
+	}
+
+	spinlock_acquire(&rw->rw_spinlock);
+	while (1) {
+		word = rw->rw_word;
+		if ((word & (RW_WRITER | RW_READMASK)) == 0) {
+			/*
+			 * Free. Keep the waiter bits that still apply
+			 * so that our release goes the slow way and
+			 * hands the lock on.
+			 */
+			newword = RW_WRITER | (word & RW_RWAIT);
+			if (rw->rw_nwwait > 0) {
+				newword |= RW_WWAIT;
+			}
+			if (atomic_cas(&rw->rw_word, word, newword) == word) {
+				break;
+			}
+			continue;
+		}
+		if ((word & RW_WWAIT) == 0) {
+			/* This also stops new readers getting in. */
+			if (atomic_cas(&rw->rw_word, word,
+				       word | RW_WWAIT) != word) {
+				continue;
+			}
+		}
+
+		rw->rw_nwwait++;
+		wchan_lock(rw->rw_wwchan);
+		spinlock_release(&rw->rw_spinlock);
+		wchan_sleep(rw->rw_wwchan);
+
+		spinlock_acquire(&rw->rw_spinlock);
+		KASSERT(rw->rw_nwwait > 0);
+		rw->rw_nwwait--;
+	}
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_spinlock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rwlock_do_i_hold_write(rw));
+
+	/* Must clear this before the word, or we'd race the next writer. */
+	rw->rw_writer = NULL;
+
+	/* Fast path: nobody is waiting. */
+	if (atomic_cas(&rw->rw_word, RW_WRITER, 0) == RW_WRITER) {
+		return;
+	}
+
+	/*
+	 * While RW_WRITER is set nobody else changes the word without
+	 * holding the spinlock, so we can just store it.
+	 */
+	spinlock_acquire(&rw->rw_spinlock);
+	KASSERT(rw->rw_word & RW_WRITER);
+	rw->rw_word &= ~RW_WRITER;
+	rwlock_wake(rw);
+	spinlock_release(&rw->rw_spinlock);
+}
+
+bool
+rwlock_tryupgrade(struct rwlock *rw)
+{
+	unsigned word;
+
+	KASSERT(rw != NULL);
+
+	while (1) {
+		word = rw->rw_word;
+		KASSERT((word & RW_WRITER) == 0);
+		KASSERT((word & RW_READMASK) > 0);
+		if ((word & RW_READMASK) != 1) {
+			/* Other readers are in; can't upgrade. */
+			return false;
+		}
+		if (atomic_cas(&rw->rw_word, word,
+			       (word & ~RW_READMASK) | RW_WRITER) == word) {
+			break;
+		}
+	}
+	rw->rw_writer = curthread;
+	return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	unsigned word;
+
+	KASSERT(rw != NULL);
+	KASSERT(rwlock_do_i_hold_write(rw));
+
+	spinlock_acquire(&rw->rw_spinlock);
+	rw->rw_writer = NULL;
+	word = (rw->rw_word & ~RW_WRITER) + 1;
+	if (rw->rw_nwwait == 0 && (word & RW_RWAIT)) {
+		/* No writer to prefer, so waiting readers can join us. */
+		rw->rw_word = word & ~RW_RWAIT;
+		wchan_wakeall(rw->rw_rwchan);
+	}
+	else {
+		rw->rw_word = word;
+	}
+	spinlock_release(&rw->rw_spinlock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	return rw->rw_writer == curthread;
 }
@@ -48,8 +48,11 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <clock.h>
 #include <mainbus.h>
+#include <kmem_cache.h>
 #include <vnode.h>
+#include <workq.h>
 
 #include "opt-synchprobs.h"
 
@@ -57,6 +60,41 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Exited threads are kept, with their stacks, in a per-cpu cache of
+ * up to THREADCACHE_MAX for reuse by thread_fork. Names up to
+ * THREAD_NAMESIZE bytes reuse the old name buffer too.
+ */
+#define THREADCACHE_MAX		16
+#define THREAD_NAMESIZE		32
+
+/*
+ * Scheduler tuning. A thread at run queue level L may run for
+ * SCHED_QUANTUM(L) hardclocks before it is demoted to level L+1.
+ * Every SCHED_BOOST_HARDCLOCKS hardclocks schedule() moves every
+ * thread back to level 0 so CPU-bound threads are not starved; this
+ * must be a multiple of SCHEDULE_HARDCLOCKS in clock.c.
+ */
+#define SCHED_QUANTUM(level)	(1 << (level))
+#define SCHED_BOOST_HARDCLOCKS	100	/* once a second at HZ=100 */
+
+/*
+ * A thread that stopped running on some CPU less than
+ * thread_hot_hardclocks ago probably still has its working set in
+ * that CPU's cache. The load balancer leaves such threads alone
+ * unless the imbalance it is fixing is more than SCHED_HOT_IMBALANCE
+ * threads.
+ */
+unsigned thread_hot_hardclocks = 2;
+#define SCHED_HOT_IMBALANCE	4
+
+/*
+ * Longest stretch without hardclocks (see clock.c). An idle CPU wakes
+ * up this often to look for work to steal; a CPU running one thread
+ * this often to account its time.
+ */
+#define SCHED_TICKLESS_HARDCLOCKS	HZ	/* once a second */
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -69,9 +107,26 @@ DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
 static struct cpuarray allcpus;
 
+/* Mask of all the cpus in allcpus */
+static uint32_t presentcpus;
+
+/* Where threads wait to be moved to a cpu they're allowed on */
+static struct wchan *thread_movewchan;
+
+/* Object caches for thread structures and wait channels */
+static struct kmem_cache *thread_objcache;
+static struct kmem_cache *wchan_objcache;
+
+/* List of all threads, for thread_printtop; see t_allnext */
+static struct thread *allthreads;
+static struct spinlock allthreads_lock = SPINLOCK_INITIALIZER;
+
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+static void thread_initfields(struct thread *thread);
+static bool thread_steal(void);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -120,38 +175,114 @@ struct thread *
 thread_create(const char *name)
 {
 	struct thread *thread;
+	size_t len;
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_objcache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
-	thread->t_name = kstrdup(name);
+	/* Leave room for the thread cache to reuse the name buffer */
+	len = strlen(name) + 1;
+	thread->t_name = kmalloc(len < THREAD_NAMESIZE ? THREAD_NAMESIZE : len);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_objcache, thread);
 		return NULL;
 	}
+	strcpy(thread->t_name, name);
+	thread->t_stack = NULL;
+
+	thread_initfields(thread);
+	return thread;
+}
+
+/*
+ * Initialize the fields of a new or recycled thread, other than the
+ * name and stack.
+ */
+static
+void
+thread_initfields(struct thread *thread)
+{
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_quantum = SCHED_QUANTUM(0);
+	thread->t_lastcpu = NULL;
+	thread->t_lastrun = 0;
+	thread->t_rqcpu = NULL;
+	thread->t_rqlevel = 0;
+	thread->t_cpumask = CPUMASK_ALL;
+	thread->t_inherited = SCHED_NLEVELS;
+	thread->t_blockedon = NULL;
+	thread->t_pilevel = SCHED_NLEVELS;
+	thread->t_pilocks = NULL;
+	thread->t_utime = 0;
+	thread->t_stime = 0;
+	thread->t_acctstamp = 0;
+	thread->t_rqstamp = 0;
+	thread->t_rqwait = 0;
+	thread->t_nvcsw = 0;
+	thread->t_nivcsw = 0;
+	thread->t_allnext = NULL;
+	thread->t_allprev = NULL;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Public fields */
+	thread->t_tid = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
+}
 
-	return thread;
+/*
+ * Add a thread to, or remove it from, the list of all threads.
+ */
+static
+void
+thread_link(struct thread *t)
+{
+	KASSERT(t->t_allprev == NULL);
+
+	spinlock_acquire(&allthreads_lock);
+	t->t_allnext = allthreads;
+	if (allthreads != NULL) {
+		allthreads->t_allprev = &t->t_allnext;
+	}
+	t->t_allprev = &allthreads;
+	allthreads = t;
+	spinlock_release(&allthreads_lock);
+}
+
+static
+void
+thread_unlink(struct thread *t)
+{
+	if (t->t_allprev == NULL) {
+		/* A startup thread that was never linked */
+		return;
+	}
+
+	spinlock_acquire(&allthreads_lock);
+	*t->t_allprev = t->t_allnext;
+	if (t->t_allnext != NULL) {
+		t->t_allnext->t_allprev = t->t_allprev;
+	}
+	t->t_allnext = NULL;
+	t->t_allprev = NULL;
+	spinlock_release(&allthreads_lock);
 }
 
 /*
@@ -167,6 +298,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -180,10 +312,36 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_hardclocks0 = 0;
+	c->c_steals = 0;
+	c->c_stealfails = 0;
+	c->c_migrations = 0;
+	c->c_tickperiod = 1;
+	c->c_ticksavoided = 0;
+	c->c_lastclock = 0;
+	c->c_idletime = 0;
+	c->c_vcsw = 0;
+	c->c_ivcsw = 0;
+	for (i=0; i<SPINLOCK_MCSNODES; i++) {
+		c->c_mcsnodes[i].mn_inuse = false;
+	}
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+	c->c_tickless = false;
+	c->c_rqwait = 0;
+	c->c_rqdispatches = 0;
+	spinlock_init_kind(&c->c_runqueue_lock, SPINLOCK_MCS);
+
+	threadlist_init(&c->c_threadcache);
+	c->c_threadcache_hits = 0;
+	c->c_threadcache_misses = 0;
+	spinlock_init(&c->c_threadcache_lock);
+
+	workq_initcpu(c);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -193,6 +351,11 @@ cpu_create(unsigned hardware_number)
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	if (c->c_number >= CPU_MAX) {
+		panic("cpu_create: More than %d cpus\n", CPU_MAX);
+	}
+	kheap_initcpu(c->c_number);
+	presentcpus |= CPUMASK_BIT(c);
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -252,6 +415,9 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
+	KASSERT(thread->t_blockedon == NULL);
+	KASSERT(thread->t_pilocks == NULL);
+	KASSERT(thread->t_allprev == NULL);
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -259,12 +425,147 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_objcache, thread);
+}
+
+/*
+ * Put an exited thread in the current cpu's thread cache, or destroy
+ * it if it has no stack of its own or the cache is full.
+ */
+static
+void
+threadcache_put(struct thread *thread)
+{
+	struct cpu *c;
+
+	KASSERT(thread->t_proc == NULL);
+	if (thread->t_stack == NULL) {
+		thread_destroy(thread);
+		return;
+	}
+
+	/* It stays a zombie until threadcache_get resets it. */
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_threadcache_lock);
+	if (c->c_threadcache.tl_count < THREADCACHE_MAX) {
+		threadlist_addhead(&c->c_threadcache, thread);
+		thread = NULL;
+	}
+	spinlock_release(&c->c_threadcache_lock);
+
+	if (thread != NULL) {
+		thread_destroy(thread);
+	}
+}
+
+/*
+ * Take a thread, with stack, from the current cpu's thread cache and
+ * set it up as if by thread_create. Returns NULL if the cache is
+ * empty (or we're out of memory for a long name).
+ */
+static
+struct thread *
+threadcache_get(const char *name)
+{
+	struct cpu *c;
+	struct thread *thread;
+	char *newname;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_threadcache_lock);
+	thread = threadlist_remhead(&c->c_threadcache);
+	if (thread != NULL) {
+		c->c_threadcache_hits++;
+	}
+	else {
+		c->c_threadcache_misses++;
+	}
+	spinlock_release(&c->c_threadcache_lock);
+
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (strlen(name) < THREAD_NAMESIZE) {
+		strcpy(thread->t_name, name);
+	}
+	else {
+		newname = kstrdup(name);
+		if (newname == NULL) {
+			thread_destroy(thread);
+			return NULL;
+		}
+		kfree(thread->t_name);
+		thread->t_name = newname;
+	}
+	thread_initfields(thread);
+	return thread;
+}
+
+/*
+ * Free every cached thread on every cpu. Called by kmalloc when it
+ * runs out of memory. Returns the number of threads freed.
+ */
+unsigned
+threadcache_reclaim(void)
+{
+	struct threadlist victims;
+	struct thread *t;
+	struct cpu *c;
+	unsigned i, numcpus, count;
+
+	threadlist_init(&victims);
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_threadcache_lock);
+		while ((t = threadlist_remhead(&c->c_threadcache)) != NULL) {
+			threadlist_addtail(&victims, t);
+		}
+		spinlock_release(&c->c_threadcache_lock);
+	}
+
+	count = 0;
+	while ((t = threadlist_remhead(&victims)) != NULL) {
+		thread_destroy(t);
+		count++;
+	}
+	threadlist_cleanup(&victims);
+	return count;
+}
+
+/*
+ * Print each cpu's thread cache occupancy and hit rate.
+ */
+void
+threadcache_printstats(void)
+{
+	unsigned i, numcpus, count, hits, misses;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_threadcache_lock);
+		count = c->c_threadcache.tl_count;
+		hits = c->c_threadcache_hits;
+		misses = c->c_threadcache_misses;
+		spinlock_release(&c->c_threadcache_lock);
+
+		kprintf("cpu%u: %u/%u cached, %u hits, %u misses",
+			c->c_number, count, THREADCACHE_MAX, hits, misses);
+		if (hits + misses > 0) {
+			kprintf(" (%u%% hit rate)",
+				hits * 100 / (hits + misses));
+		}
+		kprintf("\n");
+	}
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) They go into the
+ * thread cache if there's room.
  *
  * The list of zombies is per-cpu.
  */
@@ -277,7 +578,7 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		threadcache_put(z);
 	}
 }
 
@@ -289,6 +590,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +606,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -351,6 +657,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_objcache = kmem_cache_create("thread",
+					    sizeof(struct thread), 0, NULL);
+	if (thread_objcache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -380,9 +692,23 @@ thread_bootstrap(void)
 	/* cpu_create() should have set t_proc. */
 	KASSERT(curthread->t_proc != NULL);
 
+	/* The boot thread goes on to run the menu; count it. */
+	thread_link(curthread);
+
+	thread_movewchan = wchan_create("cpumove");
+	if (thread_movewchan == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/* Done */
 }
 
+uint32_t
+cpu_presentmask(void)
+{
+	return presentcpus;
+}
+
 /*
  * New CPUs come here once MD initialization is finished. curthread
  * and curcpu should already be initialized.
@@ -398,10 +724,21 @@ cpu_hatch(unsigned software_number)
 	KASSERT(curthread != NULL);
 	KASSERT(curcpu->c_number == software_number);
 
+	/*
+	 * Start counting hardclocks from where the boot cpu has got
+	 * to, so clock_cycles() roughly agrees across cpus. Remember
+	 * where we started so top doesn't count the time before we
+	 * were up as busy.
+	 */
+	curcpu->c_hardclocks =
+		cpuarray_get(&allcpus, 0)->c_hardclocks;
+	curcpu->c_hardclocks0 = curcpu->c_hardclocks;
+
 	spl0();
 
 	kprintf("cpu%u: %s\n", software_number, cpu_identify());
 
+	workq_start();
 	V(cpu_startup_sem);
 	thread_exit();
 }
@@ -416,6 +753,7 @@ thread_start_cpus(void)
 
 	kprintf("cpu0: %s\n", cpu_identify());
 
+	workq_start();
 	cpu_startup_sem = sem_create("cpu_hatch", 0);
 	mainbus_start_cpus();
 	
@@ -426,6 +764,211 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. The caller must hold the cpu's run queue
+ * lock.
+ *
+ * runqueue_add queues a thread at the tail of the level given by its
+ * effective priority (t_priority, or better if it has inherited a
+ * level through a lock), and records where it put it in t_rqcpu and
+ * t_rqlevel so it can be found again. runqueue_remhead takes the
+ * thread that should run next (the head of the highest-priority
+ * nonempty level), and accounts for how long it waited there.
+ * runqueue_remcold picks a thread to give to another cpu.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	KASSERT(t->t_rqcpu == NULL);
+	/* Set t_rqcpu before reading t_inherited; see thread_setinherited */
+	t->t_rqcpu = c;
+	t->t_rqlevel = thread_effpriority(t);
+	threadlist_addtail(&c->c_runqueue[t->t_rqlevel], t);
+	c->c_runcount++;
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	uint64_t now, wait;
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			t->t_rqcpu = NULL;
+
+			/* Stamps from other cpus may be a bit ahead */
+			now = clock_cycles();
+			wait = now > t->t_rqstamp ? now - t->t_rqstamp : 0;
+			t->t_rqwait += wait;
+			c->c_rqwait += wait;
+			c->c_rqdispatches++;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Check if a thread ran recently enough that its cache footprint is
+ * likely still on the cpu it ran on. Uses that cpu's hardclock
+ * count, which is read without locking; it only ever goes up.
+ */
+static
+bool
+thread_ishot(struct thread *t)
+{
+	if (t->t_lastcpu == NULL) {
+		return false;
+	}
+	return (t->t_lastcpu->c_hardclocks - t->t_lastrun
+		< thread_hot_hardclocks);
+}
+
+/*
+ * Take the thread nearest the end of the run queue (the one that
+ * would run last) that is not cache-hot, or regardless of hotness if
+ * ALLOWHOT is set, and that may run on at least one of the cpus in
+ * DESTMASK. Returns NULL if there's no such thread.
+ *
+ * The cpu's curthread is never taken, even though it can be on the
+ * run queue briefly while the cpu unidles; see the comment in
+ * thread_consider_migration.
+ */
+static
+struct thread *
+runqueue_remcold(struct cpu *c, bool allowhot, uint32_t destmask)
+{
+	struct threadlistnode *tln;
+	struct thread *t;
+	unsigned i;
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		for (tln = c->c_runqueue[i].tl_tail.tln_prev;
+		     tln->tln_prev != NULL;
+		     tln = tln->tln_prev) {
+			t = tln->tln_self;
+			if (t == c->c_curthread) {
+				continue;
+			}
+			if (!allowhot && thread_ishot(t)) {
+				continue;
+			}
+			if ((t->t_cpumask & destmask) == 0) {
+				continue;
+			}
+			threadlist_remove(&c->c_runqueue[i], t);
+			c->c_runcount--;
+			t->t_rqcpu = NULL;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The level a thread is actually scheduled at: its own, or the one it
+ * inherited through a lock it holds, whichever is better.
+ */
+unsigned
+thread_effpriority(struct thread *t)
+{
+	return t->t_inherited < t->t_priority ? t->t_inherited : t->t_priority;
+}
+
+/*
+ * Set the level a thread inherits through locks. If it's sitting on a
+ * run queue, move it to the queue for its new effective level.
+ *
+ * runqueue_add sets t_rqcpu and then reads t_inherited; we do the
+ * opposite. So either it picks up the new level, or we see it on the
+ * queue and fix it up under that queue's lock.
+ */
+void
+thread_setinherited(struct thread *t, unsigned level)
+{
+	struct cpu *c;
+
+	KASSERT(level <= SCHED_NLEVELS);
+
+	t->t_inherited = level;
+	while ((c = t->t_rqcpu) != NULL) {
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_rqcpu != c) {
+			/* It moved; try again. */
+			spinlock_release(&c->c_runqueue_lock);
+			continue;
+		}
+		if (t->t_rqlevel != thread_effpriority(t)) {
+			threadlist_remove(&c->c_runqueue[t->t_rqlevel], t);
+			t->t_rqlevel = thread_effpriority(t);
+			threadlist_addtail(&c->c_runqueue[t->t_rqlevel], t);
+		}
+		spinlock_release(&c->c_runqueue_lock);
+		break;
+	}
+}
+
+/*
+ * Move a thread to run queue level LEVEL with a fresh quantum. The
+ * thread must not currently be on a run queue, or the caller must
+ * move it between lists itself.
+ */
+static
+void
+thread_setlevel(struct thread *t, unsigned level)
+{
+	KASSERT(level < SCHED_NLEVELS);
+	t->t_priority = level;
+	t->t_quantum = SCHED_QUANTUM(level);
+}
+
+/*
+ * CPU affinity.
+ *
+ * thread_canrun says whether a thread may run on a cpu. thread_pickcpu
+ * chooses a cpu for a thread that can't stay where it is: an idle one
+ * in MASK if there is one, otherwise the least loaded, going by the
+ * unlocked run queue counts.
+ */
+static
+bool
+thread_canrun(struct thread *t, struct cpu *c)
+{
+	return (t->t_cpumask & CPUMASK_BIT(c)) != 0;
+}
+
+static
+struct cpu *
+thread_pickcpu(uint32_t mask)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus;
+
+	best = NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if ((mask & CPUMASK_BIT(c)) == 0) {
+			continue;
+		}
+		if (c->c_isidle) {
+			return c;
+		}
+		if (best == NULL || c->c_runcount < best->c_runcount) {
+			best = c;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,11 +993,14 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
-	if (isidle) {
+	target->t_rqstamp = clock_cycles();
+	runqueue_add(targetcpu, target);
+	if (isidle || targetcpu->c_tickless) {
 		/*
 		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
+		 * sure it unidles. Or it has stopped its timer
+		 * because it had only one thread to run, and now
+		 * needs it back to share the cpu.
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
@@ -465,38 +1011,103 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Wake up a thread waiting in thread_moveaway. Runs on the worker
+ * thread of the cpu it was on, so by now it's off that cpu.
  */
-int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+static
+void
+thread_movework(void *data)
 {
-	struct thread *newthread;
-	int result;
-
-#ifdef UW
-	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
-#endif // UW
+	struct thread *t = data;
 
-	newthread = thread_create(name);
-	if (newthread == NULL) {
-		return ENOMEM;
-	}
+	wchan_lock(thread_movewchan);
+	wchan_wakethread(thread_movewchan, t);
+	wchan_unlock(thread_movewchan);
+}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+/*
+ * Get the current thread onto a cpu it's allowed on. We can't put
+ * ourselves on another cpu's run queue while we're still running
+ * here, so go to sleep and have this cpu's worker thread (see workq.c)
+ * wake us up; thread_wakeup_place then sends us somewhere allowed.
+ * The worker is bound to this cpu, so it can't run until we're off
+ * it. Before the worker exists, stay put.
+ */
+static
+void
+thread_moveaway(void)
+{
+	struct work wk;
+
+	work_init(&wk, thread_movework, curthread);
+	while (1) {
+		/* Holding the wchan lock keeps us on this cpu. */
+		wchan_lock(thread_movewchan);
+		if (thread_canrun(curthread, curcpu) ||
+		    curcpu->c_work_wchan == NULL) {
+			wchan_unlock(thread_movewchan);
+			break;
+		}
+		work_queue(&wk);
+		wchan_sleep(thread_movewchan);
+	}
+}
+
+int
+thread_setcpumask(struct thread *t, uint32_t mask)
+{
+	mask &= presentcpus;
+	if (mask == 0) {
+		return EINVAL;
+	}
+	t->t_cpumask = mask;
+	if (t == curthread) {
+		KASSERT(!curthread->t_in_interrupt);
+		thread_moveaway();
+	}
+	return 0;
+}
+
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It may run on the cpus in the
+ * process's p_cpumask; a kernel thread instead gets kproc's mask if P
+ * is given, or the caller's if P is null. It starts on the same CPU
+ * as the caller if it's allowed there, unless the scheduler intervenes
+ * first.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	struct thread *newthread;
+	int result;
+
+#ifdef UW
+	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
+#endif // UW
+
+	/* Recycle an exited thread if we can */
+	newthread = threadcache_get(name);
+	if (newthread == NULL) {
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
+
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
 	}
 	thread_checkstack_init(newthread);
 
@@ -504,12 +1115,16 @@ thread_fork(const char *name,
 	 * Now we clone various fields from the parent thread.
 	 */
 
-	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
-
-	/* Attach the new thread to its process */
+	/*
+	 * Attach the new thread to its process. For a user process,
+	 * proc_addthread replaces the cpu mask with p_cpumask.
+	 */
 	if (proc == NULL) {
 		proc = curthread->t_proc;
+		newthread->t_cpumask = curthread->t_cpumask;
+	}
+	else {
+		newthread->t_cpumask = proc->p_cpumask;
 	}
 	result = proc_addthread(proc, newthread);
 	if (result) {
@@ -518,6 +1133,14 @@ thread_fork(const char *name,
 		return result;
 	}
 
+	/* Thread subsystem fields */
+	if (thread_canrun(newthread, curthread->t_cpu)) {
+		newthread->t_cpu = curthread->t_cpu;
+	}
+	else {
+		newthread->t_cpu = thread_pickcpu(newthread->t_cpumask);
+	}
+
 	/*
 	 * Because new threads come out holding the cpu runqueue lock
 	 * (see notes at bottom of thread_switch), we need to account
@@ -528,6 +1151,8 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
+	thread_link(newthread);
+
 	/* Lock the current cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
@@ -548,6 +1173,8 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	uint64_t idlestart;
+	bool stole;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -574,12 +1201,27 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Remember where and when it last ran, for cache affinity. */
+	cur->t_lastcpu = curcpu->c_self;
+	cur->t_lastrun = curcpu->c_hardclocks;
+
+	/* Charge it for the time it ran, and count the switch. */
+	thread_charge(false);
+	if (newstate == S_READY) {
+		cur->t_nivcsw++;
+		curcpu->c_ivcsw++;
+	}
+	else {
+		cur->t_nvcsw++;
+		curcpu->c_vcsw++;
+	}
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -632,14 +1274,25 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			stole = thread_steal();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+			if (!stole && curcpu->c_runcount == 0) {
+				/* No timer ticks while idle */
+				hardclock_stop(SCHED_TICKLESS_HARDCLOCKS);
+				spinlock_release(&curcpu->c_runqueue_lock);
+				idlestart = clock_cycles();
+				cpu_idle();
+				curcpu->c_idletime +=
+					clock_cycles() - idlestart;
+				spinlock_acquire(&curcpu->c_runqueue_lock);
+			}
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	hardclock_resume();
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -705,6 +1358,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
 
+	/* Start charging it for its time from now. */
+	cur->t_acctstamp = clock_cycles();
+
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
@@ -738,6 +1394,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
 
+	/* Start charging it for its time from now. */
+	cur->t_acctstamp = clock_cycles();
+
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
@@ -799,6 +1458,8 @@ thread_exit(void)
 	/* Make sure we *are* detached (move this only if you're sure!) */
 	KASSERT(cur->t_proc == NULL);
 
+	thread_unlink(cur);
+
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
@@ -822,25 +1483,242 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Each CPU's run queue is a multi-level feedback queue: a thread
+ * always runs from the highest-priority (lowest-numbered) nonempty
+ * level, and threads within a level run round-robin. New threads
+ * start at level 0. A thread that uses up its quantum is demoted one
+ * level, and lower levels get longer quanta, so CPU-bound threads
+ * sink and run in long slices while interactive and I/O-bound ones
+ * stay near the top. A thread woken from wchan_sleep is promoted one
+ * level with a fresh quantum.
  */
 
+/*
+ * Called from hardclock() on every tick, in place of an unconditional
+ * thread_yield().
+ */
 void
-schedule(void)
+thread_tick(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *cur;
+	bool preempt;
+	unsigned i;
+
+	/* Interrupting the idle loop; there's no thread to charge. */
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur = curthread;
+	KASSERT(cur->t_quantum > 0);
+	cur->t_quantum--;
+	preempt = false;
+	if (cur->t_quantum == 0) {
+		if (cur->t_priority + 1 < SCHED_NLEVELS) {
+			thread_setlevel(cur, cur->t_priority + 1);
+		}
+		else {
+			thread_setlevel(cur, cur->t_priority);
+		}
+		preempt = true;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_runcount == 0) {
+		/*
+		 * Nobody to share the cpu with; stop the timer until
+		 * somebody turns up.
+		 */
+		hardclock_stop(SCHED_TICKLESS_HARDCLOCKS);
+		preempt = false;
+	}
+	else if (!preempt) {
+		/* Quantum not used up; only yield to higher priority. */
+		for (i=0; i<thread_effpriority(cur); i++) {
+			if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+				preempt = true;
+				break;
+			}
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * This is called periodically from hardclock(). Once every
+ * SCHED_BOOST_HARDCLOCKS it returns every thread on the current CPU
+ * to level 0, so threads that have sunk to the bottom are guaranteed
+ * to run eventually and threads that have become interactive get
+ * their priority back.
+ *
+ * THEN is c_hardclocks before this hardclock. After ticks have been
+ * skipped the count can jump past a multiple of the boost period, so
+ * test for crossing one rather than landing on it.
+ */
+void
+schedule(unsigned then)
+{
+	struct thread *t;
+	unsigned i;
+
+	if (then / SCHED_BOOST_HARDCLOCKS ==
+	    curcpu->c_hardclocks / SCHED_BOOST_HARDCLOCKS) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			thread_setlevel(t, 0);
+			t->t_rqlevel = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		thread_setlevel(curthread, 0);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Load is balanced from both ends. A CPU that runs out of work
+ * steals from the busiest other CPU before it goes idle (see
+ * thread_steal). Idle CPUs stop their ticks, though, so they only try
+ * again when something wakes them, or at worst every
+ * SCHED_TICKLESS_HARDCLOCKS. Balancing therefore mostly relies on the
+ * push side: a busy CPU pushes its excess work to less busy CPUs every
+ * MIGRATE_HARDCLOCKS (see thread_consider_migration), and sends an
+ * IPI to any idle CPU it gives work to. If it has excess work that it
+ * couldn't push, it kicks the idle CPUs anyway so they try stealing.
+ * Both sides decide by reading the other CPUs' c_runcount without
+ * locking them; a stale count costs at most a wasted or missed move.
+ */
+
+/*
+ * Steal work for the current CPU, which has nothing to run. Take
+ * up to half the run queue of the CPU with the most queued threads,
+ * lowest priority first, skipping cache-hot threads unless that CPU
+ * is badly overloaded. Returns true if anything was stolen.
+ *
+ * Only one run queue lock is held at a time, so two CPUs stealing
+ * from each other can't deadlock.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct threadlist stolen;
+	struct thread *t;
+	unsigned i, numcpus, count, best;
+	bool allowhot;
+
+	victim = NULL;
+	best = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		count = c->c_runcount;
+		if (count > best) {
+			best = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		/* Nothing to steal anywhere. */
+		return false;
+	}
+
+	threadlist_init(&stolen);
+	spinlock_acquire(&victim->c_runqueue_lock);
+	count = DIVROUNDUP(victim->c_runcount, 2);
+	allowhot = victim->c_runcount > SCHED_HOT_IMBALANCE;
+	for (i=0; i<count; i++) {
+		t = runqueue_remcold(victim, allowhot,
+				     CPUMASK_BIT(curcpu));
+		if (t == NULL) {
+			break;
+		}
+		t->t_cpu = curcpu->c_self;
+		threadlist_addhead(&stolen, t);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (threadlist_isempty(&stolen)) {
+		/* The hint was stale, or everything was cache-hot. */
+		curcpu->c_stealfails++;
+		threadlist_cleanup(&stolen);
+		return false;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&stolen)) != NULL) {
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+		      t->t_name, victim->c_number, curcpu->c_number);
+		runqueue_add(curcpu, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	curcpu->c_steals++;
+
+	threadlist_cleanup(&stolen);
+	return true;
+}
+
+/*
+ * Send away every thread on our run queue that is no longer allowed to
+ * run here, because its mask was changed while it was queued.
+ */
+static
+void
+thread_evict(void)
+{
+	struct threadlistnode *tln, *prev;
+	struct threadlist misplaced;
+	struct thread *t;
+	unsigned i;
+
+	threadlist_init(&misplaced);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		for (tln = curcpu->c_runqueue[i].tl_tail.tln_prev;
+		     tln->tln_prev != NULL;
+		     tln = prev) {
+			prev = tln->tln_prev;
+			t = tln->tln_self;
+			if (t == curcpu->c_curthread || thread_canrun(t, curcpu)) {
+				continue;
+			}
+			threadlist_remove(&curcpu->c_runqueue[i], t);
+			curcpu->c_runcount--;
+			t->t_rqcpu = NULL;
+			threadlist_addhead(&misplaced, t);
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	while ((t = threadlist_remhead(&misplaced)) != NULL) {
+		t->t_cpu = thread_pickcpu(t->t_cpumask);
+		DEBUG(DB_THREADS, "Evicted thread %s: cpu %u -> %u\n",
+		      t->t_name, curcpu->c_number, t->t_cpu->c_number);
+		thread_make_runnable(t, false);
+		curcpu->c_migrations++;
+	}
+	threadlist_cleanup(&misplaced);
+}
+
+/*
+ * Push excess work to other CPUs. This is called periodically from
+ * hardclock(). If the current CPU is busy and other CPUs are idle,
+ * or less busy, it moves threads across to those other CPUs.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
@@ -848,29 +1726,33 @@ schedule(void)
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * So threads that ran within the last thread_hot_hardclocks are left
+ * where they are, unless there are more than SCHED_HOT_IMBALANCE
+ * threads to move. The window can be changed from the kernel menu.
  */
 void
 thread_consider_migration(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
+	unsigned my_count, total_count, count, one_share, to_send;
+	unsigned wanted, moved;
+	bool allowhot;
+	unsigned i, numcpus, skipped;
 	struct cpu *c;
 	struct threadlist victims;
 	struct thread *t;
 
+	thread_evict();
+
+	/* Count using the unlocked hints. */
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		count = c->c_runcount;
+		total_count += count;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = count;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -878,14 +1760,22 @@ thread_consider_migration(void)
 		return;
 	}
 
-	to_send = my_count - one_share;
+	to_send = wanted = my_count - one_share;
+	moved = 0;
+	allowhot = to_send > SCHED_HOT_IMBALANCE;
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remcold(curcpu, allowhot,
+				     presentcpus & ~CPUMASK_BIT(curcpu));
+		if (t == NULL) {
+			/* Only hot threads left, or the hint was stale. */
+			break;
+		}
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
+	to_send = i;
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
 		c = cpuarray_get(&allcpus, i);
@@ -893,7 +1783,8 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		skipped = 0;
+		while (c->c_runcount < one_share && skipped < to_send) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -923,11 +1814,20 @@ thread_consider_migration(void)
 				continue;
 			}
 
+			/* Not allowed there; maybe on the next cpu. */
+			if (!thread_canrun(t, c)) {
+				threadlist_addtail(&victims, t);
+				skipped++;
+				continue;
+			}
+
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
+			      "Migrated thread %s: cpu %u -> %u\n",
 			      t->t_name, curcpu->c_number, c->c_number);
+			curcpu->c_migrations++;
+			moved++;
 			to_send--;
 			if (c->c_isidle) {
 				/*
@@ -948,13 +1848,175 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
 
 	KASSERT(threadlist_isempty(&victims));
 	threadlist_cleanup(&victims);
+
+	/*
+	 * If we couldn't give away all our excess (only cache-hot
+	 * threads, or none the other cpus may run), kick idle cpus
+	 * that have stopped their ticks so they try thread_steal
+	 * instead of sleeping on for up to SCHED_TICKLESS_HARDCLOCKS.
+	 * c_isidle and c_tickless are read unlocked; they're hints.
+	 */
+	if (moved < wanted) {
+		for (i=0; i<numcpus; i++) {
+			c = cpuarray_get(&allcpus, i);
+			if (c != curcpu->c_self && c->c_isidle &&
+			    c->c_tickless) {
+				ipi_send(c, IPI_UNIDLE);
+			}
+		}
+	}
+}
+
+/*
+ * Print the length of each run queue level on each CPU, the load
+ * balancing counters, and the number of timer ticks skipped by
+ * dynamic ticks.
+ */
+void
+thread_printrunqueues(void)
+{
+	unsigned counts[SCHED_NLEVELS];
+	unsigned i, j, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+
+		/* Don't call kprintf with the run queue locked. */
+		spinlock_acquire(&c->c_runqueue_lock);
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			counts[j] = c->c_runqueue[j].tl_count;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+
+		kprintf("cpu%u:", c->c_number);
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			kprintf(" L%u: %u", j, counts[j]);
+		}
+		kprintf("\n      steals: %u failed: %u migrated: %u "
+			"ticks avoided: %u\n",
+			c->c_steals, c->c_stealfails, c->c_migrations,
+			c->c_ticksavoided);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * CPU accounting.
+ *
+ * Time is charged to a thread when it switches out, and when it goes
+ * into and out of user mode (in the trap code), so the split between
+ * user and kernel time is exact up to the clock. Time in interrupt
+ * handlers goes to whichever thread was interrupted, as kernel time,
+ * or to idle time if none was.
+ */
+void
+thread_charge(bool user)
+{
+	struct thread *cur = curthread;
+	uint64_t now;
+
+	now = clock_cycles();
+	if (user) {
+		cur->t_utime += now - cur->t_acctstamp;
+	}
+	else {
+		cur->t_stime += now - cur->t_acctstamp;
+	}
+	cur->t_acctstamp = now;
+}
+
+/* Most threads thread_printtop will list */
+#define TOP_MAX 16
+
+/* Milliseconds, as something kprintf can print */
+#define TOP_MSEC(cycles) ((unsigned long)(clock_cycles_usec(cycles) / 1000))
+
+void
+thread_printtop(unsigned ntop)
+{
+	struct {
+		char name[16];
+		uint64_t utime, stime, rqwait;
+		unsigned nvcsw, nivcsw;
+		threadstate_t state;
+	} top[TOP_MAX];
+	unsigned i, j, num, numcpus, busy;
+	uint64_t elapsed, idle, total;
+	struct cpu *c;
+	struct thread *t;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+
+		/* Unlocked; the numbers need only be roughly right. */
+		elapsed = (uint64_t)(c->c_hardclocks - c->c_hardclocks0)
+			* (mainbus_cyclefreq() / HZ);
+		idle = c->c_idletime;
+		busy = elapsed > idle ? (elapsed - idle) * 100 / elapsed : 0;
+		kprintf("cpu%u: %u%% busy, idle %lu ms, "
+			"switches %u voluntary %u involuntary\n",
+			c->c_number, busy, TOP_MSEC(idle),
+			c->c_vcsw, c->c_ivcsw);
+		kprintf("      run queue wait %lu ms over %u dispatches\n",
+			TOP_MSEC(c->c_rqwait), c->c_rqdispatches);
+	}
+
+	/*
+	 * Keep the busiest NTOP threads, sorted, as we go. Take
+	 * copies, so we don't call kprintf with the list locked.
+	 */
+	if (ntop > TOP_MAX) {
+		ntop = TOP_MAX;
+	}
+	num = 0;
+	spinlock_acquire(&allthreads_lock);
+	for (t = allthreads; t != NULL; t = t->t_allnext) {
+		total = t->t_utime + t->t_stime;
+		for (i=num; i>0; i--) {
+			if (top[i-1].utime + top[i-1].stime >= total) {
+				break;
+			}
+		}
+		if (i >= ntop) {
+			continue;
+		}
+		if (num < ntop) {
+			num++;
+		}
+		for (j=num-1; j>i; j--) {
+			top[j] = top[j-1];
+		}
+		snprintf(top[i].name, sizeof(top[i].name), "%s", t->t_name);
+		top[i].utime = t->t_utime;
+		top[i].stime = t->t_stime;
+		top[i].rqwait = t->t_rqwait;
+		top[i].nvcsw = t->t_nvcsw;
+		top[i].nivcsw = t->t_nivcsw;
+		top[i].state = t->t_state;
+	}
+	spinlock_release(&allthreads_lock);
+
+	kprintf("%-16s %5s %9s %9s %9s %7s %7s\n", "THREAD", "STATE",
+		"USER(ms)", "SYS(ms)", "WAIT(ms)", "VCSW", "IVCSW");
+	for (i=0; i<num; i++) {
+		kprintf("%-16s %5s %9lu %9lu %9lu %7u %7u\n", top[i].name,
+			top[i].state == S_RUN ? "run" :
+			top[i].state == S_READY ? "ready" : "sleep",
+			TOP_MSEC(top[i].utime), TOP_MSEC(top[i].stime),
+			TOP_MSEC(top[i].rqwait), top[i].nvcsw,
+			top[i].nivcsw);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -963,6 +2025,31 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Wait channels come from an object cache. Constructed ones have
+ * their spinlock initialized and their list empty, and are always
+ * returned to the cache that way (wchan_destroy checks).
+ */
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+}
+
+void
+wchan_bootstrap(void)
+{
+	wchan_objcache = kmem_cache_create("wchan", sizeof(struct wchan),
+					   0, wchan_ctor);
+	if (wchan_objcache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -976,12 +2063,10 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_objcache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
@@ -995,7 +2080,7 @@ wchan_destroy(struct wchan *wc)
 {
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(wchan_objcache, wc);
 }
 
 /*
@@ -1028,6 +2113,115 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * Make a thread that was sleeping runnable.
+ *
+ * It is promoted one run queue level, with a fresh quantum. It goes
+ * back to the cpu it last ran on if that cpu is idle or the thread
+ * is still cache-hot there; otherwise, if some other cpu is idle
+ * (going by the unlocked c_isidle hints), it goes there rather than
+ * waiting its turn on a busy cpu. Only cpus in its t_cpumask count;
+ * if its old cpu isn't one of them any more, it goes to whichever one
+ * thread_pickcpu likes.
+ *
+ * The thread is off every list, so nobody else can be looking at its
+ * scheduling fields. But it may still be its old cpu's curthread, if
+ * that cpu went idle after it slept and hasn't chosen another thread
+ * yet; then its context hasn't been saved and it must not move. The
+ * old cpu holds its run queue lock from choosing the next thread
+ * until the switch is done, so check under that lock.
+ *
+ * thread_wakeup_place does the above and leaves the chosen cpu in
+ * t_cpu; thread_wakeup also puts the thread on that cpu's run queue.
+ */
+static
+void
+thread_wakeup_place(struct thread *target)
+{
+	struct cpu *last, *c;
+	unsigned i, numcpus;
+
+	thread_setlevel(target,
+			target->t_priority > 0 ? target->t_priority - 1 : 0);
+
+	last = target->t_cpu;
+	if (!thread_canrun(target, last)) {
+		/* It has to go somewhere else. */
+		c = thread_pickcpu(target->t_cpumask);
+		spinlock_acquire(&last->c_runqueue_lock);
+		if (last->c_curthread != target) {
+			target->t_cpu = c;
+		}
+		spinlock_release(&last->c_runqueue_lock);
+	}
+	else if (!last->c_isidle && !thread_ishot(target)) {
+		numcpus = cpuarray_num(&allcpus);
+		for (i=0; i<numcpus; i++) {
+			c = cpuarray_get(&allcpus, i);
+			if (c != last && c->c_isidle &&
+			    thread_canrun(target, c)) {
+				spinlock_acquire(&last->c_runqueue_lock);
+				if (last->c_curthread != target) {
+					target->t_cpu = c;
+				}
+				spinlock_release(&last->c_runqueue_lock);
+				break;
+			}
+		}
+	}
+}
+
+static
+void
+thread_wakeup(struct thread *target)
+{
+	thread_wakeup_place(target);
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Make every thread on LIST runnable, which leaves it empty. The
+ * threads must already have been placed. Threads going to the same
+ * cpu are added to its run queue together, under one acquisition of
+ * its lock and with at most one IPI.
+ */
+static
+void
+thread_make_runnable_batch(struct threadlist *list)
+{
+	struct threadlistnode *tln, *next;
+	struct thread *target, *t;
+	struct cpu *targetcpu;
+	bool isidle;
+
+	while ((target = threadlist_remhead(list)) != NULL) {
+		targetcpu = target->t_cpu;
+
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		isidle = targetcpu->c_isidle;
+		target->t_rqstamp = clock_cycles();
+		runqueue_add(targetcpu, target);
+
+		/* Pick out everything else bound for the same cpu. */
+		for (tln = list->tl_head.tln_next; tln->tln_next != NULL;
+		     tln = next) {
+			next = tln->tln_next;
+			t = tln->tln_self;
+			if (t->t_cpu == targetcpu) {
+				threadlist_remove(list, t);
+				t->t_rqstamp = target->t_rqstamp;
+				runqueue_add(targetcpu, t);
+			}
+		}
+
+		/* As in thread_make_runnable. */
+		if (isidle || targetcpu->c_tickless) {
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+		spinlock_release(&targetcpu->c_runqueue_lock);
+	}
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1050,7 +2244,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
-	thread_make_runnable(target, false);
+	thread_wakeup(target);
 }
 
 /*
@@ -1061,6 +2255,7 @@ wchan_wakeall(struct wchan *wc)
 {
 	struct thread *target;
 	struct threadlist list;
+	struct threadlistnode *tln;
 
 	threadlist_init(&list);
 
@@ -1079,17 +2274,66 @@ wchan_wakeall(struct wchan *wc)
 	spinlock_release(&wc->wc_lock);
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Decide where each thread is to run, then hand them over a
+	 * cpu at a time, so each run queue lock is taken and each IPI
+	 * sent only once however many threads go there.
 	 */
-	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+	for (tln = list.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		thread_wakeup_place(tln->tln_self);
 	}
+	thread_make_runnable_batch(&list);
 
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Wake up a particular thread sleeping on a wait channel. The caller
+ * holds the channel lock, so the thread can't be woken by anyone else
+ * in the meantime.
+ */
+void
+wchan_wakethread(struct wchan *wc, struct thread *target)
+{
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	threadlist_remove(&wc->wc_threads, target);
+	thread_wakeup(target);
+}
+
+/*
+ * Move sleeping threads from one channel to another. They stay
+ * asleep; it's as if they had gone to sleep on TO to begin with.
+ */
+unsigned
+wchan_transfer(struct wchan *from, struct wchan *to, unsigned max,
+	       void (*moved)(struct thread *, void *), void *data)
+{
+	struct thread *target;
+	unsigned n;
+
+	KASSERT(spinlock_do_i_hold(&from->wc_lock));
+	KASSERT(from != to);
+
+	n = 0;
+	spinlock_acquire(&to->wc_lock);
+	while (n < max) {
+		target = threadlist_remhead(&from->wc_threads);
+		if (target == NULL) {
+			break;
+		}
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+		if (moved != NULL) {
+			moved(target, data);
+		}
+		n++;
+	}
+	spinlock_release(&to->wc_lock);
+
+	return n;
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1189,7 +2433,8 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt; don't need to do anything else, except
+		 * maybe restart the timer (below).
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
@@ -1206,4 +2451,20 @@ interprocessor_interrupt(void)
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	/*
+	 * If we stopped the timer because we had only one thread to
+	 * run, somebody has probably just given us another. (If we're
+	 * idle, the idle loop restarts it when there's something to
+	 * run.) This must be done after dropping the IPI lock, because
+	 * thread_make_runnable holds our run queue lock when it sends
+	 * the IPI.
+	 */
+	if (bits & (1U << IPI_UNIDLE)) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		if (!curcpu->c_isidle) {
+			hardclock_resume();
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
 }
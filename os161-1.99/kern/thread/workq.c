@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-cpu deferred work queues. See workq.h.
+ *
+ * The queue for each cpu hangs off its struct cpu and is protected by
+ * c_work_lock. It's filled from interrupt handlers on that cpu and
+ * drained by the cpu's worker thread, which only runs on that cpu. The
+ * worker sleeps on c_work_wchan when there's nothing to do and is
+ * woken by the first item queued after that. So a burst of interrupts
+ * costs one wakeup, and the worker handles all of them in one go.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <workq.h>
+
+void
+work_init(struct work *wk, void (*func)(void *data), void *data)
+{
+	wk->wk_next = NULL;
+	wk->wk_func = func;
+	wk->wk_data = data;
+	wk->wk_queued = 0;
+}
+
+/*
+ * Queue a work item on the current cpu.
+ */
+void
+work_queue(struct work *wk)
+{
+	struct cpu *c;
+	int spl;
+
+	/* Already waiting to run; it will see whatever we wanted done. */
+	if (atomic_cas(&wk->wk_queued, 0, 1) != 0) {
+		return;
+	}
+
+	/* Stay on this cpu while we pick its queue. */
+	spl = splhigh();
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_work_lock);
+	if (c->c_work_wchan == NULL) {
+		/* No worker yet; do it now. */
+		spinlock_release(&c->c_work_lock);
+		splx(spl);
+		wk->wk_queued = 0;
+		wk->wk_func(wk->wk_data);
+		return;
+	}
+
+	wk->wk_next = NULL;
+	*c->c_work_tail = wk;
+	c->c_work_tail = &wk->wk_next;
+	if (c->c_work_idle) {
+		c->c_work_idle = false;
+		wchan_wakeone(c->c_work_wchan);
+	}
+	spinlock_release(&c->c_work_lock);
+	splx(spl);
+}
+
+/*
+ * The worker thread: take everything on the queue and run it.
+ */
+static
+void
+workq_thread(void *data1, unsigned long data2)
+{
+	struct cpu *c = data1;
+	struct work *wk, *next;
+
+	(void)data2;
+
+	spinlock_acquire(&c->c_work_lock);
+	while (1) {
+		while (c->c_work_head == NULL) {
+			c->c_work_idle = true;
+			wchan_lock(c->c_work_wchan);
+			spinlock_release(&c->c_work_lock);
+			wchan_sleep(c->c_work_wchan);
+			spinlock_acquire(&c->c_work_lock);
+		}
+		wk = c->c_work_head;
+		c->c_work_head = NULL;
+		c->c_work_tail = &c->c_work_head;
+		spinlock_release(&c->c_work_lock);
+
+		for (; wk != NULL; wk = next) {
+			/* Once wk_queued is clear it may be requeued. */
+			next = wk->wk_next;
+			wk->wk_queued = 0;
+			wk->wk_func(wk->wk_data);
+		}
+
+		spinlock_acquire(&c->c_work_lock);
+	}
+}
+
+void
+workq_initcpu(struct cpu *c)
+{
+	c->c_work_head = NULL;
+	c->c_work_tail = &c->c_work_head;
+	c->c_work_wchan = NULL;
+	c->c_work_idle = false;
+	spinlock_init(&c->c_work_lock);
+}
+
+/*
+ * Start the worker thread for the current cpu. It's bound to this cpu
+ * (it gets its cpu mask from the forking thread, so restrict ourselves
+ * for the moment).
+ */
+void
+workq_start(void)
+{
+	struct cpu *c = curcpu->c_self;
+	struct wchan *wc;
+	char name[16];
+	uint32_t savedmask;
+	int result;
+
+	KASSERT(c->c_work_wchan == NULL);
+
+	snprintf(name, sizeof(name), "work%u", c->c_number);
+	wc = wchan_create("workq");
+	if (wc == NULL) {
+		panic("workq_start: Out of memory\n");
+	}
+
+	/*
+	 * Set c_work_wchan before the thread runs, so that anything
+	 * queued from here on waits for it instead of running inline.
+	 * The worker takes the lock before looking at the queue.
+	 */
+	spinlock_acquire(&c->c_work_lock);
+	c->c_work_wchan = wc;
+	spinlock_release(&c->c_work_lock);
+
+	savedmask = curthread->t_cpumask;
+	curthread->t_cpumask = CPUMASK_BIT(c);
+	result = thread_fork(name, NULL, workq_thread, c, 0);
+	curthread->t_cpumask = savedmask;
+	if (result) {
+		panic("workq_start: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
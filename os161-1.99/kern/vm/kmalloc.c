@@ -30,10 +30,18 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <mainbus.h>
 #include <vm.h>
+#include <kmem_cache.h>
 
 /*
  * Kernel malloc.
+ *
+ * Fixed-size objects that are allocated often are better off in an
+ * object cache; see kmem_cache.c.
  */
 
 
@@ -86,6 +94,9 @@ fill_deadbeef(void *vptr, size_t len)
 #define NSIZES 8
 static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 
+/* Per-cpu magazine capacity for each size; see below. */
+static const unsigned kmagsizes[NSIZES] = { 64, 32, 16, 8, 4, 2, 2, 2 };
+
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
@@ -101,9 +112,16 @@ struct freelist {
 	struct freelist *next;
 };
 
+/*
+ * Pages with free blocks are on the list for their size; all pages
+ * are on the all list. Both are doubly linked so pages can come off
+ * in constant time. prev_samesize is NULL for full pages.
+ */
 struct pageref {
 	struct pageref *next_samesize;
+	struct pageref **prev_samesize;
 	struct pageref *next_all;
+	struct pageref **prev_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -117,85 +135,118 @@ struct pageref {
 
 ////////////////////////////////////////
 
+static struct pageref *sizebases[NSIZES];
+static struct pageref *allbase;
+
+////////////////////////////////////////
+
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
+ * One spinlock protects the pages and their free lists.
+ */
+
+static struct spinlock kmalloc_spinlock =
+	SPINLOCK_INITIALIZER_KIND(SPINLOCK_MCS);
+
+/*
+ * Per-cpu magazines. Each cpu keeps a stack of free blocks of each
+ * size, linked through the blocks themselves, so most kmalloc and
+ * kfree calls only take the current cpu's magazine lock. An empty
+ * magazine is refilled with KMAG_BATCH blocks from the global lists
+ * at once, and a full one gives back that many, so kmalloc_spinlock
+ * is taken once per batch instead of once per call.
  *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Blocks sitting in magazines count as allocated as far as their
+ * pages are concerned; kmag_flushall gives them back when memory
+ * runs short.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * The magazine lock is never held together with kmalloc_spinlock.
  */
+#define KMAG_BATCH(blktype) (kmagsizes[blktype] / 2)
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+struct kmagazine {
+	struct freelist *km_head;	/* free blocks */
+	unsigned km_count;		/* number of blocks on km_head */
+};
+
+struct kmagcpu {
+	struct kmagazine kc_mags[NSIZES];
+	unsigned kc_hits;		/* kmallocs served from a magazine */
+	unsigned kc_misses;		/* kmallocs that had to refill */
+	unsigned kc_flushes;		/* kfrees that had to flush */
+	struct spinlock kc_lock;
+};
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct kmagcpu kmagcpus[CPU_MAX];
+static unsigned kmag_ncpus;
+
+////////////////////////////////////////
+
+/*
+ * Pagerefs are allocated a page at a time as the heap grows, and
+ * kept on a free list (through next_samesize) while not in use.
+ * Pages of pagerefs are never given back; the overhead is one page
+ * per 170 pages of heap.
+ */
+
+static struct pageref *freepagerefs;
+static unsigned npagerefs;	/* total, in use or not */
+
+/*
+ * kpagemap maps each physical page to its pageref, if it's one of
+ * ours, so kfree can find a block's page in constant time. It has
+ * an entry for every page of RAM and is set up by kheap_bootstrap.
+ */
+
+static struct pageref **kpagemap;
+static unsigned kpagemap_size;
+
+#define KPAGEMAP_INDEX(va) (((va) - MIPS_KSEG0) / PAGE_SIZE)
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *p;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
-	}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	/* ran out */
-	return NULL;
+	p = freepagerefs;
+	if (p != NULL) {
+		freepagerefs = p->next_samesize;
+	}
+	return p;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
-}
-
-////////////////////////////////////////
-
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-////////////////////////////////////////
+	p->pageaddr_and_blocktype = 0;
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
+}
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Put a fresh page worth of pagerefs on the free list.
  */
+static
+void
+addpagerefs(vaddr_t page)
+{
+	struct pageref *p;
+	unsigned i, n;
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	p = (struct pageref *)page;
+	n = PAGE_SIZE / sizeof(struct pageref);
+	for (i=0; i<n; i++) {
+		freepageref(&p[i]);
+	}
+	npagerefs += n;
+}
 
 ////////////////////////////////////////
 
@@ -260,18 +311,22 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(pr->nfree > 0);
+			KASSERT(*pr->prev_samesize == pr);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(*pr->prev_all == pr);
+		KASSERT(kpagemap[KPAGEMAP_INDEX(PR_PAGEADDR(pr))] == pr);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
-	KASSERT(sc==ac);
+	KASSERT(sc<=ac);
 }
 #else
 #define checksubpages() 
@@ -334,6 +389,8 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct kmagcpu *kc;
+	unsigned i, j, count, hits, misses, flushes;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -345,32 +402,138 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kprintf("Per-cpu magazines (blocks in them show as in use):\n");
+	for (i=0; i<kmag_ncpus; i++) {
+		kc = &kmagcpus[i];
+		spinlock_acquire(&kc->kc_lock);
+		count = 0;
+		for (j=0; j<NSIZES; j++) {
+			count += kc->kc_mags[j].km_count;
+		}
+		hits = kc->kc_hits;
+		misses = kc->kc_misses;
+		flushes = kc->kc_flushes;
+		spinlock_release(&kc->kc_lock);
+
+		kprintf("cpu%u: %u blocks cached, %u hits, %u misses, "
+			"%u flushes\n", i, count, hits, misses, flushes);
+	}
+
+	kmem_cache_printstats();
+}
+
+/*
+ * Allocate kpagemap. Called early in boot, before the first kmalloc.
+ */
+void
+kheap_bootstrap(void)
+{
+	size_t ramsize;
+	unsigned i, npages;
+	vaddr_t map;
+
+	/* We can only reach memory that's in KSEG0. */
+	ramsize = mainbus_ramsize();
+	if (ramsize > MIPS_KSEG1 - MIPS_KSEG0) {
+		ramsize = MIPS_KSEG1 - MIPS_KSEG0;
+	}
+
+	kpagemap_size = ramsize / PAGE_SIZE;
+	npages = DIVROUNDUP(kpagemap_size * sizeof(struct pageref *),
+			    PAGE_SIZE);
+	map = alloc_kpages(npages);
+	if (map == 0) {
+		panic("kheap_bootstrap: Out of memory\n");
+	}
+	kpagemap = (struct pageref **)map;
+	for (i=0; i<kpagemap_size; i++) {
+		kpagemap[i] = NULL;
+	}
+}
+
+/*
+ * Set up the magazines for cpu number CPUNUM. Called by cpu_create.
+ */
+void
+kheap_initcpu(unsigned cpunum)
+{
+	struct kmagcpu *kc;
+	unsigned i;
+
+	KASSERT(cpunum < CPU_MAX);
+	kc = &kmagcpus[cpunum];
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_mags[i].km_head = NULL;
+		kc->kc_mags[i].km_count = 0;
+	}
+	kc->kc_hits = 0;
+	kc->kc_misses = 0;
+	kc->kc_flushes = 0;
+	spinlock_init(&kc->kc_lock);
+
+	if (cpunum >= kmag_ncpus) {
+		kmag_ncpus = cpunum + 1;
+	}
 }
 
 ////////////////////////////////////////
 
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+add_samesize(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
-
 	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(pr->prev_samesize == NULL);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = &pr->next_samesize;
 	}
+	pr->prev_samesize = &sizebases[blktype];
+	sizebases[blktype] = pr;
+}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+static
+void
+remove_samesize(struct pageref *pr)
+{
+	KASSERT(pr->prev_samesize != NULL);
+
+	*pr->prev_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = NULL;
+	pr->prev_samesize = NULL;
+}
+
+static
+void
+add_lists(struct pageref *pr, int blktype)
+{
+	pr->prev_samesize = NULL;
+	add_samesize(pr, blktype);
+
+	pr->next_all = allbase;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = &pr->next_all;
+	}
+	pr->prev_all = &allbase;
+	allbase = pr;
+}
+
+static
+void
+remove_lists(struct pageref *pr)
+{
+	if (pr->prev_samesize != NULL) {
+		remove_samesize(pr);
+	}
+
+	*pr->prev_all = pr->next_all;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
 	}
 }
 
@@ -392,62 +555,110 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Find the pageref for the page ADDR is on, or NULL if it isn't a
+ * subpage allocator page.
+ *
+ * This is safe to call without kmalloc_spinlock as long as the caller
+ * owns a block on the page: the page (and thus its kpagemap entry)
+ * can't change underneath us, and the entry is cleared before the
+ * page is given back, so it can't be stale either.
+ */
 static
-void *
-subpage_kmalloc(size_t sz)
+struct pageref *
+findpageref(vaddr_t addr)
+{
+	unsigned index;
+
+	if (addr < MIPS_KSEG0 || addr >= MIPS_KSEG1) {
+		return NULL;
+	}
+	index = KPAGEMAP_INDEX(addr);
+	if (index >= kpagemap_size) {
+		return NULL;
+	}
+	return kpagemap[index];
+}
+
+/*
+ * Take one block off the free list of page PR, which must have some.
+ * If that was the last one, the page comes off its size list.
+ */
+static
+struct freelist *
+subpage_popblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	struct freelist *ret;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	ret = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+		remove_samesize(pr);
+	}
+	return ret;
+}
+
+/*
+ * Get up to N free blocks of type BLKTYPE from the global free lists,
+ * getting a fresh page if there aren't any, and link them onto *HEAD.
+ * Returns the number of blocks obtained; 0 means we're out of memory.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, struct freelist **head, unsigned n)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	struct freelist *blk;
+	vaddr_t refpage;	// new page of pagerefs
+	unsigned got = 0;
 
 	volatile int i;
 
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
-
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	/* Every page on the size list has at least one free block. */
+	while (got < n && (pr = sizebases[blktype]) != NULL) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
-
-			checksubpages();
+		blk = subpage_popblock(pr);
+		blk->next = *head;
+		*head = blk;
+		got++;
+	}
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
+	if (got > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return got;
 	}
 
 	/*
@@ -464,17 +675,23 @@ subpage_kmalloc(size_t sz)
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+		return 0;
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+	while ((pr = allocpageref()) == NULL) {
+		/* Out of pagerefs; get another page of them. */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		refpage = alloc_kpages(1);
+		if (refpage==0) {
+			/* Couldn't get accounting space for the page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"pageref\n");
+			return 0;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		addpagerefs(refpage);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -498,35 +715,47 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	add_lists(pr, blktype);
+	KASSERT(KPAGEMAP_INDEX(prpage) < kpagemap_size);
+	kpagemap[KPAGEMAP_INDEX(prpage)] = pr;
 
-	pr->next_all = allbase;
-	allbase = pr;
+	while (pr->nfree > 0 && got < n) {
+		blk = subpage_popblock(pr);
+		blk->next = *head;
+		*head = blk;
+		got++;
+	}
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return got;
 }
 
+/*
+ * Return a list of blocks (of any sizes) to their pages, and give
+ * back any pages that become entirely free.
+ */
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_putblocks(struct freelist *list)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-
-	ptraddr = (vaddr_t)ptr;
+	struct freelist *next;
+	struct freelist *freepages = NULL;
+	int blktype;		// index into sizes[] that we're using
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
+	for (fl = list; fl != NULL; fl = next) {
+		next = fl->next;
+
+		pr = findpageref((vaddr_t)fl);
+		KASSERT(pr != NULL);
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
 
@@ -534,18 +763,163 @@ subpage_kfree(void *ptr)
 		KASSERT(blktype>=0 && blktype<NSIZES);
 		checksubpage(pr);
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+		/*
+		 * We probably ought to check for free twice by seeing
+		 * if the block is already on the free list. But
+		 * that's expensive, so we don't.
+		 */
+
+		if (pr->freelist_offset == INVALID_OFFSET) {
+			fl->next = NULL;
+		} else {
+			fl->next = (struct freelist *)
+				(prpage + pr->freelist_offset);
+		}
+		pr->freelist_offset = (vaddr_t)fl - prpage;
+		if (pr->nfree == 0) {
+			/* Has free blocks again. */
+			add_samesize(pr, blktype);
+		}
+		pr->nfree++;
+
+		KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+		if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+			/*
+			 * Whole page is free. Chain it through its
+			 * first word to free after we drop the lock.
+			 */
+			remove_lists(pr);
+			kpagemap[KPAGEMAP_INDEX(prpage)] = NULL;
+			freepageref(pr);
+			fl = (struct freelist *)prpage;
+			fl->next = freepages;
+			freepages = fl;
 		}
 	}
 
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	while (freepages != NULL) {
+		fl = freepages;
+		freepages = fl->next;
+		free_kpages((vaddr_t)fl);
+	}
+}
+
+/*
+ * Lock and return the current cpu's magazines, or NULL if there's no
+ * current cpu yet (early in boot).
+ */
+static
+struct kmagcpu *
+kmag_lock(void)
+{
+	struct kmagcpu *kc;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	kc = &kmagcpus[curcpu->c_number];
+	spinlock_acquire(&kc->kc_lock);
+	return kc;
+}
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct kmagcpu *kc;	// current cpu's magazines
+	struct kmagazine *km;	// the magazine for blktype
+	struct freelist *head;	// blocks from the global lists
+	struct freelist *fl;	// our result
+	struct freelist *blk;
+	unsigned n;
+
+	blktype = blocktype(sz);
+
+	kc = kmag_lock();
+	if (kc == NULL) {
+		head = NULL;
+		if (subpage_getblocks(blktype, &head, 1) == 0) {
+			return NULL;
+		}
+		return head;
+	}
+
+	km = &kc->kc_mags[blktype];
+	fl = km->km_head;
+	if (fl != NULL) {
+		km->km_head = fl->next;
+		km->km_count--;
+		kc->kc_hits++;
+		spinlock_release(&kc->kc_lock);
+		return fl;
+	}
+	kc->kc_misses++;
+	spinlock_release(&kc->kc_lock);
+
+	/*
+	 * The magazine is empty; refill it with half a magazine's
+	 * worth from the global lists. We might have moved to another
+	 * cpu meanwhile, and frees might have put things in the
+	 * magazine; either is harmless, but anything that won't fit
+	 * goes straight back.
+	 */
+	head = NULL;
+	n = subpage_getblocks(blktype, &head, KMAG_BATCH(blktype));
+	if (n == 0) {
+		return NULL;
+	}
+	fl = head;
+	head = head->next;
+
+	kc = kmag_lock();
+	km = &kc->kc_mags[blktype];
+	while (head != NULL && km->km_count < kmagsizes[blktype]) {
+		blk = head;
+		head = blk->next;
+		blk->next = km->km_head;
+		km->km_head = blk;
+		km->km_count++;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (head != NULL) {
+		subpage_putblocks(head);
+	}
+	return fl;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t offset;		// offset into page
+	struct kmagcpu *kc;	// current cpu's magazines
+	struct kmagazine *km;	// the magazine for blktype
+	struct freelist *fl;	// ptr, as a free list entry
+	struct freelist *flush;	// blocks to give back to the global lists
+	struct freelist *last;	// last block in flush
+	unsigned i;
+
+	ptraddr = (vaddr_t)ptr;
+
+	pr = findpageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
-	offset = ptraddr - prpage;
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	offset = ptraddr - PR_PAGEADDR(pr);
 
 	/* Check for proper positioning and alignment */
 	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
@@ -558,48 +932,85 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	fl = ptr;
+	fl->next = NULL;
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	kc = kmag_lock();
+	if (kc == NULL) {
+		subpage_putblocks(fl);
+		return 0;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+
+	/*
+	 * If the magazine is full, take half of it out to return to
+	 * the global lists once we've let go of the magazine.
+	 */
+	km = &kc->kc_mags[blktype];
+	flush = NULL;
+	if (km->km_count >= kmagsizes[blktype]) {
+		flush = last = km->km_head;
+		for (i=1; i<KMAG_BATCH(blktype); i++) {
+			last = last->next;
+		}
+		km->km_head = last->next;
+		last->next = NULL;
+		km->km_count -= KMAG_BATCH(blktype);
+		kc->kc_flushes++;
 	}
+	fl->next = km->km_head;
+	km->km_head = fl;
+	km->km_count++;
+	spinlock_release(&kc->kc_lock);
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+	if (flush != NULL) {
+		subpage_putblocks(flush);
+	}
 
 	return 0;
 }
 
+/*
+ * Empty every cpu's magazines into the global lists, so that pages
+ * they were holding can be freed. Called when kmalloc runs out of
+ * memory. Returns the number of blocks given back.
+ */
+static
+unsigned
+kmag_flushall(void)
+{
+	struct kmagcpu *kc;
+	struct freelist *list, *fl;
+	unsigned i, j, count;
+
+	count = 0;
+	for (i=0; i<kmag_ncpus; i++) {
+		kc = &kmagcpus[i];
+		list = NULL;
+		spinlock_acquire(&kc->kc_lock);
+		for (j=0; j<NSIZES; j++) {
+			while ((fl = kc->kc_mags[j].km_head) != NULL) {
+				kc->kc_mags[j].km_head = fl->next;
+				fl->next = list;
+				list = fl;
+				count++;
+			}
+			kc->kc_mags[j].km_count = 0;
+		}
+		spinlock_release(&kc->kc_lock);
+
+		if (list != NULL) {
+			subpage_putblocks(list);
+		}
+	}
+	return count;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
+static
 void *
-kmalloc(size_t sz)
+kmalloc_once(size_t sz)
 {
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
@@ -618,6 +1029,29 @@ kmalloc(size_t sz)
 	return subpage_kmalloc(sz);
 }
 
+void *
+kmalloc(size_t sz)
+{
+	void *ptr;
+	unsigned freed;
+
+	ptr = kmalloc_once(sz);
+	if (ptr == NULL) {
+		/*
+		 * Memory might be tied up in cached threads, empty
+		 * slabs, or per-cpu magazines; if any was given back,
+		 * try again.
+		 */
+		freed = threadcache_reclaim();
+		freed += kmem_cache_reap();
+		freed += kmag_flushall();
+		if (freed > 0) {
+			ptr = kmalloc_once(sz);
+		}
+	}
+	return ptr;
+}
+
 void
 kfree(void *ptr)
 {
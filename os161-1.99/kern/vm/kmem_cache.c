@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+/*
+ * Object caches.
+ *
+ * Each slab is one page. The slab header sits at the end of the page,
+ * so the slab an object belongs to is found from the object's address
+ * alone. Objects are laid out after a "color" offset that steps
+ * through the space left over at the end of the page from one slab to
+ * the next, so the same object in different slabs doesn't always land
+ * on the same cache lines.
+ *
+ * A free object is linked into its slab's free list through one
+ * pointer-sized word. Without a constructor, that's the first word of
+ * the object; with one, it's an extra word after the object, so as
+ * not to clobber the constructed state.
+ *
+ * A cache keeps its slabs on three lists: partial (some objects free),
+ * full, and empty. Allocation takes from a partial slab if there is
+ * one, so objects stay packed into as few pages as possible. Up to
+ * KMEM_EMPTY_MAX empty slabs are kept to soak up alloc/free cycles;
+ * more are given back to the VM system.
+ */
+
+/* Default and minimum alignment; the same as kmalloc's */
+#define KMEM_ALIGN	8
+
+/* Empty slabs each cache holds on to */
+#define KMEM_EMPTY_MAX	1
+
+struct kmem_slab {
+	struct kmem_slab *ks_next;	/* Next on the same list */
+	struct kmem_slab **ks_prev;	/* Pointer to us on that list */
+	struct kmem_cache *ks_cache;	/* Cache we belong to */
+	void *ks_free;			/* First free object */
+	unsigned ks_inuse;		/* Objects allocated */
+};
+
+/* Space in a page for objects, and where in it the header goes */
+#define KMEM_SLABSPACE	(PAGE_SIZE - sizeof(struct kmem_slab))
+#define KMEM_SLAB(addr) \
+	((struct kmem_slab *)(((vaddr_t)(addr) & PAGE_FRAME) + KMEM_SLABSPACE))
+
+/* The free list link of object OBJ */
+#define KMEM_LINK(kc, obj) \
+	(*(void **)((char *)(obj) + (kc)->kc_linkoff))
+
+struct kmem_cache {
+	/* Fixed at creation */
+	const char *kc_name;
+	size_t kc_size;			/* Object size asked for */
+	size_t kc_align;		/* Object alignment */
+	size_t kc_stride;		/* Object spacing in a slab */
+	size_t kc_linkoff;		/* Offset of free link in object */
+	unsigned kc_perslab;		/* Objects in each slab */
+	size_t kc_maxcolor;		/* Space left over in each slab */
+	void (*kc_ctor)(void *obj);
+
+	/* Protected by kc_lock */
+	size_t kc_nextcolor;		/* Color offset of the next slab */
+	struct kmem_slab *kc_partial;
+	struct kmem_slab *kc_full;
+	struct kmem_slab *kc_empty;
+	unsigned kc_nempty;
+	unsigned kc_slabs;		/* Slabs (pages) held */
+	unsigned kc_inuse;		/* Objects allocated now */
+	unsigned kc_maxinuse;		/* Most ever allocated at once */
+	unsigned kc_allocs;		/* Calls to kmem_cache_alloc */
+	unsigned kc_frees;		/* Calls to kmem_cache_free */
+	struct spinlock kc_lock;
+
+	/* Protected by kmem_caches_lock */
+	struct kmem_cache *kc_next;
+};
+
+/*
+ * List of all caches, for kmem_cache_reap and kmem_cache_printstats.
+ * When both are needed, get this lock before any cache's kc_lock.
+ */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Slab list operations.
+ */
+static
+void
+slab_insert(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_next = *list;
+	if (*list != NULL) {
+		(*list)->ks_prev = &ks->ks_next;
+	}
+	ks->ks_prev = list;
+	*list = ks;
+}
+
+static
+void
+slab_remove(struct kmem_slab *ks)
+{
+	*ks->ks_prev = ks->ks_next;
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = NULL;
+	ks->ks_prev = NULL;
+}
+
+/*
+ * Set up a fresh page as a slab for KC, constructing its objects.
+ * COLOR is the offset of the first object. Called without kc_lock, as
+ * the constructor might need to take locks of its own.
+ */
+static
+struct kmem_slab *
+slab_init(struct kmem_cache *kc, vaddr_t page, size_t color)
+{
+	struct kmem_slab *ks;
+	char *obj;
+	unsigned i;
+
+	ks = KMEM_SLAB(page);
+	ks->ks_next = NULL;
+	ks->ks_prev = NULL;
+	ks->ks_cache = kc;
+	ks->ks_free = NULL;
+	ks->ks_inuse = 0;
+
+	/* Link them backwards, so the first one is handed out first. */
+	for (i=kc->kc_perslab; i-- > 0; ) {
+		obj = (char *)page + color + i * kc->kc_stride;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor(obj);
+		}
+		KMEM_LINK(kc, obj) = ks->ks_free;
+		ks->ks_free = obj;
+	}
+	return ks;
+}
+
+/*
+ * Get a page for a new slab. If there isn't one, memory might be tied
+ * up in the thread cache or in other caches' empty slabs; give that
+ * back and try again.
+ */
+static
+vaddr_t
+slab_getpage(void)
+{
+	vaddr_t page;
+	unsigned freed;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		freed = threadcache_reclaim();
+		freed += kmem_cache_reap();
+		if (freed > 0) {
+			page = alloc_kpages(1);
+		}
+	}
+	return page;
+}
+
+////////////////////////////////////////////////////////////
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(size > 0);
+	KASSERT((align & (align - 1)) == 0);
+	if (align < KMEM_ALIGN) {
+		align = KMEM_ALIGN;
+	}
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_align = align;
+	if (ctor != NULL) {
+		/* Free link goes after the object. */
+		kc->kc_linkoff = ROUNDUP(size, sizeof(void *));
+		kc->kc_stride = kc->kc_linkoff + sizeof(void *);
+	}
+	else {
+		/* Free link overlays the start of the object. */
+		kc->kc_linkoff = 0;
+		kc->kc_stride = size;
+	}
+	kc->kc_stride = ROUNDUP(kc->kc_stride, align);
+	if (kc->kc_stride > KMEM_SLABSPACE) {
+		panic("kmem_cache_create: %s: %lu-byte objects don't fit "
+		      "in a page\n", name, (unsigned long)size);
+	}
+	kc->kc_perslab = KMEM_SLABSPACE / kc->kc_stride;
+	kc->kc_maxcolor = KMEM_SLABSPACE - kc->kc_perslab * kc->kc_stride;
+	kc->kc_ctor = ctor;
+
+	kc->kc_nextcolor = 0;
+	kc->kc_partial = NULL;
+	kc->kc_full = NULL;
+	kc->kc_empty = NULL;
+	kc->kc_nempty = 0;
+	kc->kc_slabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_maxinuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_frees = 0;
+	spinlock_init(&kc->kc_lock);
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+	struct kmem_slab *ks;
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL);
+	KASSERT(kc->kc_full == NULL);
+	while ((ks = kc->kc_empty) != NULL) {
+		slab_remove(ks);
+		free_kpages((vaddr_t)ks & PAGE_FRAME);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	size_t color;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_partial == NULL) {
+		if (kc->kc_empty != NULL) {
+			ks = kc->kc_empty;
+			slab_remove(ks);
+			kc->kc_nempty--;
+			slab_insert(&kc->kc_partial, ks);
+			break;
+		}
+
+		/*
+		 * Make a new slab. Don't hold the lock across
+		 * alloc_kpages, which might come back here; so
+		 * someone else may have made one meanwhile, and we
+		 * go around again to check.
+		 */
+		color = kc->kc_nextcolor;
+		kc->kc_nextcolor += kc->kc_align;
+		if (kc->kc_nextcolor > kc->kc_maxcolor) {
+			kc->kc_nextcolor = 0;
+		}
+		spinlock_release(&kc->kc_lock);
+
+		page = slab_getpage();
+		if (page == 0) {
+			return NULL;
+		}
+		ks = slab_init(kc, page, color);
+
+		spinlock_acquire(&kc->kc_lock);
+		slab_insert(&kc->kc_partial, ks);
+		kc->kc_slabs++;
+	}
+
+	ks = kc->kc_partial;
+	KASSERT(ks->ks_free != NULL);
+	obj = ks->ks_free;
+	ks->ks_free = KMEM_LINK(kc, obj);
+	ks->ks_inuse++;
+	if (ks->ks_inuse == kc->kc_perslab) {
+		KASSERT(ks->ks_free == NULL);
+		slab_remove(ks);
+		slab_insert(&kc->kc_full, ks);
+	}
+
+	kc->kc_allocs++;
+	kc->kc_inuse++;
+	if (kc->kc_inuse > kc->kc_maxinuse) {
+		kc->kc_maxinuse = kc->kc_inuse;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks, *extra;
+	vaddr_t offset;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	ks = KMEM_SLAB(obj);
+	if (ks->ks_cache != kc) {
+		panic("kmem_cache_free: %p is not from cache %s\n",
+		      obj, kc->kc_name);
+	}
+	offset = (vaddr_t)obj & ~PAGE_FRAME;
+	if (offset >= kc->kc_maxcolor + kc->kc_perslab * kc->kc_stride) {
+		panic("kmem_cache_free: invalid addr %p\n", obj);
+	}
+
+	extra = NULL;
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(ks->ks_inuse > 0);
+	if (ks->ks_inuse == kc->kc_perslab) {
+		/* Was full; now partial. */
+		slab_remove(ks);
+		slab_insert(&kc->kc_partial, ks);
+	}
+	KMEM_LINK(kc, obj) = ks->ks_free;
+	ks->ks_free = obj;
+	ks->ks_inuse--;
+	if (ks->ks_inuse == 0) {
+		slab_remove(ks);
+		if (kc->kc_nempty < KMEM_EMPTY_MAX) {
+			slab_insert(&kc->kc_empty, ks);
+			kc->kc_nempty++;
+		}
+		else {
+			extra = ks;
+			kc->kc_slabs--;
+		}
+	}
+	kc->kc_frees++;
+	kc->kc_inuse--;
+	spinlock_release(&kc->kc_lock);
+
+	/* Call free_kpages without the lock, as in kmalloc. */
+	if (extra != NULL) {
+		free_kpages((vaddr_t)extra & PAGE_FRAME);
+	}
+}
+
+unsigned
+kmem_cache_reap(void)
+{
+	struct kmem_cache *kc;
+	struct kmem_slab *ks, *reaped;
+	unsigned count;
+
+	/* Collect the empty slabs, then free them with no locks held. */
+	reaped = NULL;
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		while ((ks = kc->kc_empty) != NULL) {
+			slab_remove(ks);
+			kc->kc_nempty--;
+			kc->kc_slabs--;
+			slab_insert(&reaped, ks);
+		}
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+
+	count = 0;
+	while ((ks = reaped) != NULL) {
+		slab_remove(ks);
+		free_kpages((vaddr_t)ks & PAGE_FRAME);
+		count++;
+	}
+	return count;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	/* As in kheap_printstats, print with the list locked. */
+	spinlock_acquire(&kmem_caches_lock);
+
+	kprintf("Object caches:\n");
+	kprintf("%-16s %5s %5s %4s %5s %6s %6s %9s %9s\n", "name",
+		"size", "slot", "/pg", "pages", "inuse", "max",
+		"allocs", "frees");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		kprintf("%-16s %5lu %5lu %4u %5u %6u %6u %9u %9u\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			(unsigned long)kc->kc_stride, kc->kc_perslab,
+			kc->kc_slabs, kc->kc_inuse, kc->kc_maxinuse,
+			kc->kc_allocs, kc->kc_frees);
+	}
+
+	spinlock_release(&kmem_caches_lock);
+}
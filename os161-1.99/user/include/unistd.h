@@ -38,8 +38,10 @@
  * about the kern/ headers.
  */
 #include <kern/fcntl.h>
+#include <kern/futex.h>
 #include <kern/ioctl.h>
 #include <kern/reboot.h>
+#include <kern/resource.h>
 #include <kern/seek.h>
 #include <kern/time.h>
 #include <kern/unistd.h>
@@ -154,6 +156,14 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
+int __thread_create(void (*start)(int (*)(void *), void *),
+		    int (*func)(void *), void *arg);
+int thread_join(int tid, int *status);
+__DEAD void thread_exit(int code);
+int futex(volatile int *addr, int op, int val);
+int sched_setaffinity(pid_t pid, const unsigned *mask);
+int sched_getaffinity(pid_t pid, unsigned *mask);
+int getrusage(int who, struct rusage *usage);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -163,5 +173,6 @@ int __getcwd(char *buf, size_t buflen);
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int thread_create(int (*func)(void *), void *arg); /* calls __thread_create */
 
 #endif /* _UNISTD_H_ */
@@ -29,20 +29,14 @@
 
 /*
  * Test multiple user level threads inside a process. The program
- * forks 3 threads off 2 to functions, each of which displays a string
- * every once in a while.
+ * creates 3 threads running 2 functions, each of which displays a
+ * string every once in a while, then waits for all of them.
  *
- * This won't do much of anything unless you implement user-level
- * threads.
- *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * It uses the thread API from <unistd.h>: thread_create() starts a
+ * thread running a function, a thread exits by returning from that
+ * function (or calling thread_exit()), and thread_join() waits for a
+ * thread and collects its exit code. When the process exits, via
+ * _exit() or by returning from main, all its threads go away.
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
@@ -51,6 +45,7 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <err.h>
 
 #define NTHREADS  3
 #define MAX       1<<25
@@ -61,25 +56,35 @@
 volatile int count = 0;
 
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+int ThreadRunner(void *);
+int BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
-    int i;
+    int i, status;
+    int tids[NTHREADS];
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
 	if (i)
-	    threadfork(ThreadRunner);
+	    tids[i] = thread_create(ThreadRunner, NULL);
         else
-	    threadfork(BladeRunner);
+	    tids[i] = thread_create(BladeRunner, NULL);
+	if (tids[i] < 0) {
+	    err(1, "thread_create");
+	}
+    }
+
+    for (i=0; i<NTHREADS; i++) {
+	if (thread_join(tids[i], &status)) {
+	    err(1, "thread_join");
+	}
     }
 
-    printf("Parent has left.\n");
+    printf("\nParent has left.\n");
     return 0;
 }
 
@@ -88,23 +93,27 @@ main(int argc, char *argv[])
    random results.
 */
 
-void
-BladeRunner()
+int
+BladeRunner(void *junk)
 {
+    (void)junk;
     while (count < MAX) {
 	if (count % 500 == 0)
 	    printf("Blade ");
 	count++;
     }
+    return 0;
 }
 
-void
-ThreadRunner()
+int
+ThreadRunner(void *junk)
 {
+    (void)junk;
     while (count < MAX) {
 	if (count % 513 == 0)
 	    printf(" Runner\n");
 	count++;
     }
+    return 0;
 }
     